@@ -0,0 +1,149 @@
+// Diffuse cone tracing shared by vct.frag, irradianceCache.comp and
+// lightInjection.comp. The including shader defines
+//     vec4 sampleVoxels(vec3 position, float lod, vec3 direction);
+// which the cones sample, most through sampleGrid with its own volumes.
+#define MIPMAP_CAP 7.0f
+
+uniform vec3 worldCenter;
+uniform vec3 worldSizeHalf;
+uniform float voxelSize; // of the traced resolution
+uniform int separateOpacity;
+uniform int mipmapFilter; // 1: dense mips store opacity weighted color
+uniform int anisotropicVoxels;
+
+/* Rigid proxy */
+uniform int hasProxy;
+uniform sampler3D proxyVolume; // object space voxels of the dynamic meshes
+uniform mat4 proxyInverse; // world space to proxy texture coordinates
+uniform float proxyLodOffset; // proxy lod of lod 0 of the grid
+/* Rigid proxy */
+
+vec4 sampleVoxels(vec3 position, float lod, vec3 direction);
+
+vec3 orthogonal(vec3 u) {
+    u = normalize(u);
+    vec3 v = normalize(vec3(1));
+    return abs(dot(u, v)) > 0.99999f ? cross(u, vec3(0, 1, 0)) : cross(u, v);
+}
+
+// The opacity of voxel formats without alpha is in a separate volume.
+vec4 sampleVoxelTexture(sampler3D voxels, sampler3D opacity, vec3 coords, float lod) {
+    vec4 voxel = textureLod(voxels, coords, lod);
+    if (separateOpacity == 1) {
+        voxel.a = textureLod(opacity, coords, lod).r;
+    }
+    return voxel;
+}
+
+// Level 0 of the directional volumes is mip 1 of the voxel texture. Filtering
+// is clamped to the inside of the block of the direction.
+vec4 sampleDirection(sampler3D directional, int direction, vec3 coords, float lod) {
+    int level = min(int(ceil(lod)), textureQueryLevels(directional) - 1);
+    float blockSize = float(textureSize(directional, level).x / 6);
+    coords.x = clamp(coords.x, 0.5 / blockSize, 1.0 - 0.5 / blockSize);
+    coords.x = (float(direction) + coords.x) / 6.0;
+    return textureLod(directional, coords, lod);
+}
+
+// Each axis samples the volume of the direction the cone travels along it,
+// weighted by how much of the cone direction lies on that axis.
+vec4 sampleDirectional(sampler3D directional, vec3 coords, float lod, vec3 direction) {
+    vec3 weight = direction * direction;
+    return weight.x * sampleDirection(directional, direction.x > 0.0 ? 0 : 1, coords, lod) +
+           weight.y * sampleDirection(directional, direction.y > 0.0 ? 2 : 3, coords, lod) +
+           weight.z * sampleDirection(directional, direction.z > 0.0 ? 4 : 5, coords, lod);
+}
+
+// The proxy is only sampled where the cone footprint overlaps its bounds,
+// through the inverse of its transform. It has no directional mips.
+vec4 sampleProxy(vec3 position, float lod) {
+    vec3 coords = (proxyInverse * vec4(position, 1.0)).xyz;
+    float radius = 0.5 * voxelSize * exp2(lod) * length(proxyInverse[0].xyz);
+    if (any(lessThan(coords, vec3(-radius))) ||
+        any(greaterThan(coords, vec3(1.0 + radius)))) {
+        return vec4(0.0);
+    }
+    vec4 voxel = textureLod(proxyVolume, coords, lod + proxyLodOffset);
+    if (mipmapFilter == 1) {
+        voxel.rgb *= voxel.a;
+    }
+    return voxel;
+}
+
+vec4 sampleDenseVoxels(sampler3D voxels, sampler3D opacity, sampler3D directional,
+                       vec3 coords, float lod, vec3 direction) {
+    if (anisotropicVoxels == 1 && lod > 0.0) {
+        if (lod < 1.0) {
+            return mix(sampleVoxelTexture(voxels, opacity, coords, 0.0),
+                       sampleDirectional(directional, coords, 0.0, direction), lod);
+        }
+        return sampleDirectional(directional, coords, lod - 1.0, direction);
+    }
+    vec4 voxel = sampleVoxelTexture(voxels, opacity, coords, lod);
+    if (mipmapFilter == 1) {
+        voxel.rgb *= voxel.a;
+    }
+    return voxel;
+}
+
+// A dense volume over the world box, with the proxy composited in front of
+// the grid it overlaps.
+vec4 sampleGrid(sampler3D voxels, sampler3D opacity, sampler3D directional,
+                vec3 position, float lod, vec3 direction) {
+    vec3 coords = 0.5 * (position - worldCenter) / worldSizeHalf + 0.5;
+    vec4 voxel = sampleDenseVoxels(voxels, opacity, directional, coords, lod, direction);
+    if (hasProxy == 1) {
+        vec4 proxy = sampleProxy(position, lod);
+        voxel = proxy + (1.0 - proxy.a) * voxel;
+    }
+    return voxel;
+}
+
+// The cone starts the given distance away from its origin. Alpha is the
+// distance at which the cone is half occluded, the end of the cone if it
+// never is.
+vec4 traceDiffuseCone(const vec3 from, vec3 direction, float start) {
+    direction = normalize(direction);
+    const float aperture = 0.767;
+
+    vec4 acc = vec4(0.0f);
+    float occlusion = 0.0;
+    float maxDist = max(worldSizeHalf.x, max(worldSizeHalf.y, worldSizeHalf.z));
+    float hitDist = maxDist;
+    float dist = start;
+
+    while (dist < maxDist && acc.a < 1) {
+        vec3 conePosition = from + dist * direction;
+        float level = log2(1 + aperture * dist / voxelSize);
+        float lsquared = (level + 1) * (level + 1);
+        vec4 voxel = sampleVoxels(conePosition, min(MIPMAP_CAP, level), direction);
+        if (anisotropicVoxels == 1) {
+            // directional mips are not diluted by empty space, composite them
+            acc += (1.0 - acc.a) * voxel;
+        } else {
+            acc += 0.075 * lsquared * voxel * pow(1 - voxel.a, 2);
+        }
+        occlusion += (1.0 - occlusion) * voxel.a;
+        if (occlusion >= 0.5 && hitDist == maxDist) {
+            hitDist = dist;
+        }
+        // directional mips leak less light, the cone can take longer steps
+        dist += lsquared * voxelSize * (anisotropicVoxels == 1 ? 3.0 : 2.0);
+    }
+    return vec4(anisotropicVoxels == 1 ? acc.rgb * 0.4 : acc.rgb * 2.0, hitDist);
+}
+
+// The cone along the normal and four around it, summed. Alpha is the distance
+// the cone along the normal gets.
+vec4 traceDiffuseCones(vec3 from, vec3 normal, float start) {
+    const float ANGLE_MIX = 0.5f;
+    const vec3 ortho = normalize(orthogonal(normal));
+    const vec3 ortho2 = normalize(cross(ortho, normal));
+
+    vec4 acc = traceDiffuseCone(from, normal, start);
+    acc.rgb += traceDiffuseCone(from, mix(normal, ortho, ANGLE_MIX), start).rgb;
+    acc.rgb += traceDiffuseCone(from, mix(normal, -ortho, ANGLE_MIX), start).rgb;
+    acc.rgb += traceDiffuseCone(from, mix(normal, ortho2, ANGLE_MIX), start).rgb;
+    acc.rgb += traceDiffuseCone(from, mix(normal, -ortho2, ANGLE_MIX), start).rgb;
+    return acc;
+}
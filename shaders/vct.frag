@@ -1,5 +1,4 @@
 #version 440 core
-#define MIPMAP_CAP 7.0f
 
 in vec3 worldPosFrag;
 in vec3 normalFrag;
@@ -10,12 +9,64 @@ in vec4 lightSpacePosFrag;
 uniform vec3 lightPosition;
 uniform vec3 lightColor;
 uniform vec3 camPosition;
-uniform vec3 worldCenter;
-uniform float worldSizeHalf;
 
 uniform sampler3D voxelTexture;
+uniform sampler3D opacityTexture; // opacity of voxel formats without alpha
 uniform sampler2D shadowMap;
 
+/* Voxel backend */
+uniform int voxelBackend; // 0: dense texture, 1: sparse octree, 2: clipmap
+/* Voxel backend */
+
+/* Sparse voxel octree */
+struct Node {
+  uint child; // index of the first of 8 children, top bit marks occupancy
+  uint brick; // brick index + 1, 0 if the node has no brick
+};
+layout(std430, binding = 1) readonly buffer NodePool { Node nodes[]; };
+uniform sampler3D brickPool;
+uniform int brickPoolDim;
+uniform int octreeLevels;
+/* Sparse voxel octree */
+
+/* Clipmap */
+#define CLIPMAP_LEVELS 6
+uniform sampler3D clipmapLevels[CLIPMAP_LEVELS];
+uniform vec3 clipmapMin[CLIPMAP_LEVELS];
+uniform float clipmapVoxelSize;
+uniform int clipmapDim;
+/* Clipmap */
+
+/* Anisotropic mips */
+uniform sampler3D directionalVoxels; // +X, -X, +Y, -Y, +Z, -Z side by side along x
+/* Anisotropic mips */
+
+/* Empty space */
+uniform int skipEmptySpace;
+// a bit per voxel, 4^3 bits to a uvec2, then two OR reduced levels
+layout(std430, binding = 2) readonly buffer OccupancyMask { uvec2 occupancy[]; };
+uniform ivec3 occupancyDim; // uvec2 of level 0 along each axis
+uniform float occupancyVoxelSize;
+uniform sampler3D distanceField; // world distance to the nearest occupied uvec2
+/* Empty space */
+
+/* Irradiance cache */
+uniform int hasIrradianceCache;
+// ambient cube per 4^3 voxels, +X, -X, +Y, -Y, +Z, -Z side by side along x
+uniform sampler3D irradianceCache;
+/* Irradiance cache */
+
+/* Probe grid */
+uniform int hasIrradianceProbes;
+// ambient cube per probe laid out like the cache, alpha is how far the cone
+// along each axis gets before it is occluded
+uniform sampler3D irradianceProbes;
+uniform ivec3 probeDim;
+uniform vec3 probeMin; // world position of the first probe
+uniform float probeSpacing;
+uniform int probeVisibility; // 1: weigh the probes by whether they see us
+/* Probe grid */
+
 /* Material */
 uniform vec3 kd;
 uniform vec3 ks;
@@ -30,76 +81,263 @@ uniform sampler2D normalMap;
 /* Material */
 
 /* Settings */
-uniform int VOXEL_DIM;
 uniform bool hasDiffuseGI;
 uniform bool hasSpecularGI;
 /* Settings */
 
 out vec4 outColor;
 
-vec3 orthogonal(vec3 u){
-	u = normalize(u);
-	vec3 v = normalize(vec3(1));
-	return abs(dot(u, v)) > 0.99999f ? cross(u, vec3(0, 1, 0)) : cross(u, v);
+#include "diffuseCones.glsl"
+
+// Sample the brick of a node at the given level. Bricks have no border
+// voxels, so filtering is clamped to the inside of the brick.
+vec4 sampleBrick(uint node, vec3 coords, int level) {
+  uint brick = nodes[node].brick;
+  if (brick == 0u) {
+    return vec4(0.0);
+  }
+  brick -= 1u;
+  uint dim = uint(brickPoolDim);
+  vec3 origin = 2.0 * vec3(brick % dim, (brick / dim) % dim, brick / (dim * dim));
+  vec3 local = clamp(2.0 * fract(coords * float(1 << level)), 0.5, 1.5);
+  return textureLod(brickPool, (origin + local) / (2.0 * brickPoolDim), 0.0);
 }
 
-vec3 traceDiffuseCone(const vec3 from, vec3 direction){
-  direction = normalize(direction);
-  const float aperture = 0.767;
+// Octree equivalent of textureLod on the voxel texture: mip m lives in the
+// bricks of node level (octreeLevels - 1 - m).
+vec4 sampleOctree(vec3 coords, float lod) {
+  if (any(lessThan(coords, vec3(0.0))) || any(greaterThanEqual(coords, vec3(1.0)))) {
+    return vec4(0.0);
+  }
 
-  vec4 acc = vec4(0.0f);
-  float dist = 1.0;
+  lod = clamp(lod, 0.0, float(octreeLevels - 1));
+  int fineLevel = octreeLevels - 1 - int(lod);
+  int coarseLevel = max(fineLevel - 1, 0);
 
-	float voxelSize = 2.0 * worldSizeHalf / VOXEL_DIM;
+  vec4 fine = vec4(0.0);
+  vec4 coarse = vec4(0.0);
+  uint node = 0u;
+  for (int l = 0; l <= fineLevel; l++) {
+    if (l == coarseLevel) {
+      coarse = sampleBrick(node, coords, l);
+    }
+    if (l == fineLevel) {
+      fine = sampleBrick(node, coords, l);
+      break;
+    }
+    uint child = nodes[node].child & 0x7fffffffu;
+    if (child == 0u) {
+      break;
+    }
+    ivec3 octant = ivec3(coords * float(1 << (l + 1))) & 1;
+    node = child + uint(octant.x + 2 * octant.y + 4 * octant.z);
+  }
+  return mix(fine, coarse, fract(lod));
+}
 
-  while(dist < worldSizeHalf && acc.a < 1){
-    vec3 conePosition = from + dist * direction;
-    vec3 coords = (conePosition - worldCenter) / worldSizeHalf;
-    coords = 0.5 * coords + 0.5;
-    float level = log2(1 + aperture * dist / voxelSize);
-    float lsquared = (level + 1) * (level + 1);
-    vec4 voxel = textureLod(voxelTexture, coords, min(MIPMAP_CAP, level)); 
-    acc += 0.075 * lsquared * voxel * pow(1 - voxel.a, 2);
-    dist += lsquared * voxelSize * 2;
-	}
-	return acc.rgb * 2.0;
+// Clipmap levels are addressed toroidally, the texture wraps every
+// clipmapDim voxels of the level.
+vec4 sampleClipmapLevel(int level, vec3 position) {
+  vec3 coords = position / (clipmapVoxelSize * float(1 << level) * clipmapDim);
+  switch (level) {
+    case 0: return textureLod(clipmapLevels[0], coords, 0.0);
+    case 1: return textureLod(clipmapLevels[1], coords, 0.0);
+    case 2: return textureLod(clipmapLevels[2], coords, 0.0);
+    case 3: return textureLod(clipmapLevels[3], coords, 0.0);
+    case 4: return textureLod(clipmapLevels[4], coords, 0.0);
+    case 5: return textureLod(clipmapLevels[5], coords, 0.0);
+  }
+  return vec4(0.0);
 }
 
-vec3 indirectDiffuseLight(vec3 normal){
-	const float ANGLE_MIX = 0.5f;
-	const float w[3] = {1.0, 1.0, 1.0};
+bool insideClipmapLevel(int level, vec3 position) {
+  vec3 voxel = (position - clipmapMin[level]) / (clipmapVoxelSize * float(1 << level));
+  return all(greaterThanEqual(voxel, vec3(0.5))) && all(lessThanEqual(voxel, vec3(clipmapDim - 0.5)));
+}
+
+// The cone diameter picks the level, positions outside of a level fall back
+// to the next coarser level that contains them.
+vec4 sampleClipmap(vec3 position, float lod) {
+  lod = max(lod, 0.0);
+  int level = min(int(lod), CLIPMAP_LEVELS - 1);
+  float blend = lod - float(level);
+  while (level < CLIPMAP_LEVELS && !insideClipmapLevel(level, position)) {
+    level++;
+    blend = 0.0;
+  }
+  if (level == CLIPMAP_LEVELS) {
+    return vec4(0.0);
+  }
+
+  vec4 voxel = sampleClipmapLevel(level, position);
+  if (blend > 0.0 && level + 1 < CLIPMAP_LEVELS) {
+    voxel = mix(voxel, sampleClipmapLevel(level + 1, position), blend);
+  }
+  return voxel;
+}
+
+vec4 sampleVoxels(vec3 position, float lod, vec3 direction) {
+  if (voxelBackend == 2) {
+    return sampleClipmap(position, lod);
+  }
+
+  vec3 coords = 0.5 * (position - worldCenter) / worldSizeHalf + 0.5;
+  if (voxelBackend == 1) {
+    return sampleOctree(coords, lod);
+  }
+  return sampleGrid(voxelTexture, opacityTexture, directionalVoxels, position, lod, direction);
+}
 
-	const vec3 ortho = normalize(orthogonal(normal));
-	const vec3 ortho2 = normalize(cross(ortho, normal));
+// Distance from a position to the nearest voxel as far as the distance field
+// knows. Positions outside of the grid sample its clamped edge, they are never
+// in empty space.
+float emptyDistance(vec3 position) {
+  if (skipEmptySpace == 0) {
+    return 0.0;
+  }
+  vec3 voxel = (position - worldCenter + worldSizeHalf) / occupancyVoxelSize;
+  ivec3 cell = ivec3(floor(voxel / 4.0));
+  if (any(lessThan(cell, ivec3(0))) ||
+      any(greaterThanEqual(cell, textureSize(distanceField, 0)))) {
+    return 0.0;
+  }
+  return texelFetch(distanceField, cell, 0).r;
+}
+
+// Whether the occupancy mask shows a box of the given half size around a
+// position to be empty. The finest level whose bits are at least as wide as
+// the box tests at most 8 of them, boxes wider than the bits of the coarsest
+// level are not tested.
+bool isMaskedEmpty(vec3 position, float radius) {
+  if (skipEmptySpace == 0) {
+    return false;
+  }
+  vec3 voxel = (position - worldCenter + worldSizeHalf) / occupancyVoxelSize;
+  radius /= occupancyVoxelSize;
+  int level = 0;
+  int offset = 0;
+  ivec3 dim = occupancyDim;
+  float bitSize = 1.0;
+  while (bitSize < 2.0 * radius) {
+    if (level == 2) {
+      return false;
+    }
+    offset += dim.x * dim.y * dim.z;
+    dim = max(dim >> 2, ivec3(1));
+    bitSize *= 4.0;
+    level++;
+  }
+
+  ivec3 bitMin = ivec3(floor((voxel - radius) / bitSize));
+  ivec3 bitMax = ivec3(floor((voxel + radius) / bitSize));
+  if (any(lessThan(bitMin, ivec3(0))) || any(greaterThanEqual(bitMax, 4 * dim))) {
+    return false;
+  }
+  for (int z = bitMin.z; z <= bitMax.z; z++) {
+    for (int y = bitMin.y; y <= bitMax.y; y++) {
+      for (int x = bitMin.x; x <= bitMax.x; x++) {
+        ivec3 coord = ivec3(x, y, z) >> 2;
+        ivec3 local = ivec3(x, y, z) & 3;
+        int bit = local.x + 4 * local.y + 16 * local.z;
+        uvec2 bits = occupancy[offset + coord.x + dim.x * (coord.y + dim.y * coord.z)];
+        if (((bits[bit >> 5] >> (bit & 31)) & 1u) != 0u) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+vec3 indirectDiffuseLight(vec3 normal){
+	// directional mips keep the surface opaque, start past its own voxels
+	float start = anisotropicVoxels == 1 ? 4.0 * voxelSize : 1.0;
+	return traceDiffuseCones(worldPosFrag + normal * voxelSize, normal, start).rgb;
+}
 
-	float voxelSize = 2.0 * worldSizeHalf / VOXEL_DIM;
-	const vec3 offset = normal * voxelSize;
-	const vec3 coneOrigin = worldPosFrag + offset;
+// Blocks without voxels have no light, alpha is the weight of the ones that
+// do among the texels a lookup filters.
+vec3 sampleIrradiance(int direction, vec3 coords) {
+  float blockSize = float(textureSize(irradianceCache, 0).x / 6);
+  coords.x = clamp(coords.x, 0.5 / blockSize, 1.0 - 0.5 / blockSize);
+  coords.x = (float(direction) + coords.x) / 6.0;
+  vec4 irradiance = textureLod(irradianceCache, coords, 0.0);
+  return irradiance.a > 0.0 ? irradiance.rgb / irradiance.a : vec3(0.0);
+}
 
-	vec3 acc = vec3(0);
+// The irradiance cache holds the cones of indirectDiffuseLight along each
+// axis, weighted by how much of the normal lies on that axis.
+vec3 cachedDiffuseLight(vec3 normal) {
+  vec3 coords = 0.5 * (worldPosFrag - worldCenter) / worldSizeHalf + 0.5;
+  vec3 weight = normal * normal;
+  return weight.x * sampleIrradiance(normal.x > 0.0 ? 0 : 1, coords) +
+         weight.y * sampleIrradiance(normal.y > 0.0 ? 2 : 3, coords) +
+         weight.z * sampleIrradiance(normal.z > 0.0 ? 4 : 5, coords);
+}
 
-	// Trace front cone
-	acc += w[0] * traceDiffuseCone(coneOrigin, normal);
+vec4 probeSide(int direction, ivec3 probe) {
+  return texelFetch(irradianceProbes, probe + ivec3(direction * probeDim.x, 0, 0), 0);
+}
 
-	// Trace 4 side cones.
-	const vec3 s1 = mix(normal, ortho, ANGLE_MIX);
-	const vec3 s2 = mix(normal, -ortho, ANGLE_MIX);
-	const vec3 s3 = mix(normal, ortho2, ANGLE_MIX);
-	const vec3 s4 = mix(normal, -ortho2, ANGLE_MIX);
+vec3 probeLight(ivec3 probe, ivec3 sides, vec3 weight) {
+  return weight.x * probeSide(sides.x, probe).rgb +
+         weight.y * probeSide(sides.y, probe).rgb +
+         weight.z * probeSide(sides.z, probe).rgb;
+}
 
-	acc += w[1] * traceDiffuseCone(coneOrigin, s1);
-	acc += w[1] * traceDiffuseCone(coneOrigin, s2);
-	acc += w[1] * traceDiffuseCone(coneOrigin, s3);
-	acc += w[1] * traceDiffuseCone(coneOrigin, s4);
+// Blends the eight probes around the fragment. With visibility, probes
+// behind the surface count less, and so do those whose cones towards the
+// fragment are occluded before they reach it, like probes inside walls.
+// Without it the probes are filtered in hardware like the cache.
+vec3 probeDiffuseLight(vec3 normal) {
+  vec3 weight = normal * normal;
+  ivec3 sides = ivec3(normal.x > 0.0 ? 0 : 1, normal.y > 0.0 ? 2 : 3,
+                      normal.z > 0.0 ? 4 : 5);
+  vec3 coords = (worldPosFrag - probeMin) / probeSpacing;
+  if (probeVisibility == 0) {
+    vec3 texCoords = clamp((coords + 0.5) / vec3(probeDim), 0.5 / vec3(probeDim),
+                           1.0 - 0.5 / vec3(probeDim));
+    vec3 light = vec3(0.0);
+    for (int i = 0; i < 3; i++) {
+      vec3 sideCoords = vec3((float(sides[i]) + texCoords.x) / 6.0, texCoords.yz);
+      light += weight[i] * textureLod(irradianceProbes, sideCoords, 0.0).rgb;
+    }
+    return light;
+  }
 
-	return acc;
+  ivec3 base = clamp(ivec3(floor(coords)), ivec3(0), probeDim - 2);
+  vec3 t = clamp(coords - vec3(base), 0.0, 1.0);
+  vec3 light = vec3(0.0);
+  float total = 0.0;
+  for (int i = 0; i < 8; i++) {
+    ivec3 offset = ivec3(i & 1, (i >> 1) & 1, i >> 2);
+    ivec3 probe = base + offset;
+    vec3 trilinear = mix(1.0 - t, t, vec3(offset));
+    float w = trilinear.x * trilinear.y * trilinear.z;
+
+    vec3 toProbe = probeMin + vec3(probe) * probeSpacing - worldPosFrag;
+    float dist = length(toProbe);
+    vec3 direction = dist > 0.0 ? toProbe / dist : normal;
+    float facing = 0.5 * (dot(direction, normal) + 1.0);
+    w *= facing * facing + 0.2;
+    // the fragment is itself an occluder, the cones stop around it
+    vec3 axis = direction * direction;
+    float reach = axis.x * probeSide(direction.x > 0.0 ? 1 : 0, probe).a +
+                  axis.y * probeSide(direction.y > 0.0 ? 3 : 2, probe).a +
+                  axis.z * probeSide(direction.z > 0.0 ? 5 : 4, probe).a;
+    float visibility = clamp((reach + 0.5 * probeSpacing) / max(dist, 1e-4), 0.0, 1.0);
+    w *= visibility * visibility * visibility * visibility + 1e-4;
+
+    light += w * probeLight(probe, sides, weight);
+    total += w;
+  }
+  return light / total;
 }
 
 vec3 traceSpecularCone(vec3 from, vec3 direction, float aperture) {
-    float max_dist = worldSizeHalf / 4.0;
+    float max_dist = max(worldSizeHalf.x, max(worldSizeHalf.y, worldSizeHalf.z)) / 4.0;
     vec4 acc = vec4( 0.0 );
 
-		float voxelSize = 2.0 * worldSizeHalf / VOXEL_DIM;
     float offset = 2.0 * voxelSize;
     float dist = offset + voxelSize;
 
@@ -108,10 +346,23 @@ vec3 traceSpecularCone(vec3 from, vec3 direction, float aperture) {
         float diameter = 2.0 * aperture * dist;
         float level = log2(diameter / voxelSize);
 
-        vec3 coords = (conePosition - worldCenter) / worldSizeHalf;
-        coords = 0.5 * coords + 0.5;
-
-        vec4 voxel = textureLod(voxelTexture, coords, min(MIPMAP_CAP, level));
+        // The texels a sample filters lie within about a voxel and a cone
+        // diameter of it. Where the nearest voxel is farther, skip ahead to
+        // where the footprint could first reach it. Closer to the surfaces
+        // the mask can still show the footprint to be empty.
+        float reach = voxelSize + diameter;
+        float empty = emptyDistance(conePosition);
+        if (empty > reach) {
+            float skipTo = (empty + dist - voxelSize) / (1.0 + 2.0 * aperture);
+            dist = max(skipTo, dist + 0.5 * diameter);
+            continue;
+        }
+        if (isMaskedEmpty(conePosition, reach)) {
+            dist += 0.5 * diameter;
+            continue;
+        }
+
+        vec4 voxel = sampleVoxels(conePosition, min(MIPMAP_CAP, level), direction);
         acc += (1.0 - acc.a) * voxel;
         dist += 0.5 * diameter;
     }
@@ -179,7 +430,14 @@ void main() {
 
 	// diffuse GI
 	if (hasDiffuseGI) {
-		vec3 diffuseGI = color * indirectDiffuseLight(normal);
+		vec3 diffuseGI;
+		if (hasIrradianceCache == 1) {
+			diffuseGI = color * cachedDiffuseLight(normal);
+		} else if (hasIrradianceProbes == 1) {
+			diffuseGI = color * probeDiffuseLight(normal);
+		} else {
+			diffuseGI = color * indirectDiffuseLight(normal);
+		}
 		lighting += diffuseGI;
 	}
 	// specular GI
@@ -3,17 +3,125 @@
 in vec3 worldPositionFrag;
 
 uniform vec3 worldCenter;
-uniform float worldSizeHalf;
+uniform vec3 worldSizeHalf;
 
-layout(RGBA8) uniform image3D voxelTexture;
+uniform sampler3D voxelTexture;
+uniform sampler3D opacityTexture; // opacity of voxel formats without alpha
+uniform int separateOpacity;
+
+/* Voxel backend */
+uniform int voxelBackend; // 0: dense texture, 1: sparse octree, 2: clipmap
+/* Voxel backend */
+
+/* Sparse voxel octree */
+struct Node {
+    uint child; // index of the first of 8 children, top bit marks occupancy
+    uint brick; // brick index + 1, 0 if the node has no brick
+};
+layout(std430, binding = 1) readonly buffer NodePool { Node nodes[]; };
+uniform sampler3D brickPool;
+uniform int brickPoolDim;
+uniform int octreeLevels;
+/* Sparse voxel octree */
+
+/* Rigid proxy */
+uniform int hasProxy;
+uniform sampler3D proxyVolume; // object space voxels of the dynamic meshes
+uniform mat4 proxyInverse; // world space to proxy texture coordinates
+/* Rigid proxy */
+
+/* Clipmap */
+#define CLIPMAP_LEVELS 6
+uniform sampler3D clipmapLevels[CLIPMAP_LEVELS];
+uniform vec3 clipmapMin[CLIPMAP_LEVELS];
+uniform float clipmapVoxelSize;
+uniform int clipmapDim;
+/* Clipmap */
 
 out vec4 outColor;
 
+// Fetch the leaf voxel at the given coordinates from the octree.
+vec4 fetchOctree(vec3 coords) {
+    ivec3 position = clamp(ivec3(coords * float(1 << octreeLevels)), 0, (1 << octreeLevels) - 1);
+    uint node = 0u;
+    for (int l = 0; l < octreeLevels - 1; l++) {
+        uint child = nodes[node].child & 0x7fffffffu;
+        if (child == 0u) {
+            return vec4(0.0);
+        }
+        ivec3 octant = (position >> (octreeLevels - 1 - l)) & 1;
+        node = child + uint(octant.x + 2 * octant.y + 4 * octant.z);
+    }
+
+    uint brick = nodes[node].brick;
+    if (brick == 0u) {
+        return vec4(0.0);
+    }
+    brick -= 1u;
+    uint dim = uint(brickPoolDim);
+    ivec3 origin = 2 * ivec3(brick % dim, (brick / dim) % dim, brick / (dim * dim));
+    return texelFetch(brickPool, origin + (position & 1), 0);
+}
+
+// Fetch the voxel from the finest clipmap level containing the position.
+vec4 fetchClipmap(vec3 position) {
+    for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+        float voxelSize = clipmapVoxelSize * float(1 << level);
+        ivec3 voxel = ivec3(floor((position - clipmapMin[level]) / voxelSize));
+        if (any(lessThan(voxel, ivec3(0))) || any(greaterThanEqual(voxel, ivec3(clipmapDim)))) {
+            continue;
+        }
+
+        ivec3 coord = ivec3(floor(position / voxelSize)) % clipmapDim;
+        coord = (coord + clipmapDim) % clipmapDim;
+        switch (level) {
+            case 0: return texelFetch(clipmapLevels[0], coord, 0);
+            case 1: return texelFetch(clipmapLevels[1], coord, 0);
+            case 2: return texelFetch(clipmapLevels[2], coord, 0);
+            case 3: return texelFetch(clipmapLevels[3], coord, 0);
+            case 4: return texelFetch(clipmapLevels[4], coord, 0);
+            case 5: return texelFetch(clipmapLevels[5], coord, 0);
+        }
+    }
+    return vec4(0.0);
+}
+
 void main() {
     vec3 voxel = (worldPositionFrag - worldCenter) / worldSizeHalf; // [-1, 1]
     voxel = 0.5 * voxel + vec3(0.5); // [0, 1]
-    ivec3 dim = imageSize(voxelTexture);
+
+    if (voxelBackend == 1) {
+        outColor = fetchOctree(voxel);
+        return;
+    }
+    if (voxelBackend == 2) {
+        outColor = fetchClipmap(worldPositionFrag);
+        return;
+    }
+
+    // the dynamic meshes are only in the proxy when there is one
+    if (hasProxy == 1) {
+        vec3 proxyCoords = (proxyInverse * vec4(worldPositionFrag, 1.0)).xyz;
+        ivec3 proxyDim = textureSize(proxyVolume, 0);
+        ivec3 proxyCoord = ivec3(floor(proxyDim * proxyCoords));
+        if (all(greaterThanEqual(proxyCoord, ivec3(0))) && all(lessThan(proxyCoord, proxyDim))) {
+            vec4 proxy = texelFetch(proxyVolume, proxyCoord, 0);
+            if (proxy.a > 0.0) {
+                outColor = proxy;
+                return;
+            }
+        }
+    }
+
+    ivec3 dim = textureSize(voxelTexture, 0);
     ivec3 coord = ivec3(dim * voxel);
+    if (any(lessThan(coord, ivec3(0))) || any(greaterThanEqual(coord, dim))) {
+        outColor = vec4(0.0);
+        return;
+    }
 
-    outColor = imageLoad(voxelTexture, coord);
+    outColor = texelFetch(voxelTexture, coord, 0);
+    if (separateOpacity == 1) {
+        outColor.a = texelFetch(opacityTexture, coord, 0).r;
+    }
 }
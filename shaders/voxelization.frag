@@ -4,43 +4,21 @@ in vec3 worldPositionFrag;
 in vec3 normalFrag;
 in vec2 texCoordFrag;
 in vec4 lightSpacePosFrag;
+flat in vec4 triangleBounds; // clip space bounds of the triangle, min in xy, max in zw
 
-uniform vec3 lightPosition;
-uniform vec3 lightColor;
-uniform vec3 worldCenter;
-uniform float worldSizeHalf;
+uniform int conservative; // the triangle was grown by half a pixel
+uniform int viewportDim; // pixels along each side of the square viewport
 
-layout(RGBA8) uniform image3D voxelTexture;
-uniform sampler2D shadowMap;
+#include "voxelization.glsl"
 
-/* Material */
-uniform int hasShadows;
-uniform vec3 kd;
-uniform vec3 ke;
-uniform int hasDiffuseMap;
-uniform sampler2D diffuseMap;
-/* Material */
- 
-float shadowCalculation(vec4 fragPosLightSpace, vec3 lightDir, vec3 normal) {
-    vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-    projCoords = projCoords * 0.5 + 0.5;
-    float closestDepth = texture(shadowMap, projCoords.xy).r;
-    float currentDepth = projCoords.z;
-    float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);
-    float shadow = 0.0;
-    vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
-    for(int x = -1; x <= 1; ++x) {
-      for(int y = -1; y <= 1; ++y) {
-        float pcfDepth = texture(shadowMap, projCoords.xy + vec2(x, y) * texelSize).r;
-        shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
-      }
+void main() {
+    // drop the overshooting corners of a conservatively grown triangle
+    vec2 clipPosition = gl_FragCoord.xy / float(viewportDim) * 2.0 - 1.0;
+    if (conservative == 1 && (any(lessThan(clipPosition, triangleBounds.xy)) ||
+                              any(greaterThan(clipPosition, triangleBounds.zw)))) {
+        return;
     }
-    shadow /= 9.0;
-
-    return shadow;
-}
 
-void main() {
     vec3 color = texture(diffuseMap, texCoordFrag).rgb;
     if (hasDiffuseMap == 0) {
         color = kd;
@@ -48,6 +26,23 @@ void main() {
 
     vec3 normal = normalize(normalFrag);
 
+    vec3 voxel = (worldPositionFrag - worldCenter) / worldSizeHalf; // [-1, 1]
+    voxel = 0.5 * voxel + vec3(0.5); // [0, 1]
+
+    if (voxelTarget == 2) {
+        // only store the surface, the light is injected afterwards
+        ivec3 dim = imageSize(albedoVolume);
+        ivec3 coord = ivec3(floor(dim * voxel));
+        if (any(lessThan(coord, regionMin)) || any(greaterThanEqual(coord, regionMax))) {
+            return;
+        }
+        ivec3 local = coord - regionMin;
+        writeVoxel(1, coord, local, color);
+        writeVoxel(2, coord, local, 0.5 * normal + 0.5);
+        writeMaterial(coord);
+        return;
+    }
+
     // diffuse
     vec3 lightDir = normalize(lightPosition - worldPositionFrag);
     float diff = max(dot(lightDir, normal), 0.0);
@@ -63,9 +58,29 @@ void main() {
 
     lighting += ke * color;
 
-    vec3 voxel = (worldPositionFrag - worldCenter) / worldSizeHalf; // [-1, 1]
-    voxel = 0.5 * voxel + vec3(0.5); // [0, 1]
-    ivec3 dim = imageSize(voxelTexture);
-    ivec3 coord = ivec3(dim * voxel);
-    imageStore(voxelTexture, coord, vec4(lighting, 1.0));
+    if (voxelTarget == 1) {
+        // append the fragment, the list is only filled if it is large enough
+        uvec3 p = uvec3(clamp(ivec3(fragmentListDim * voxel), 0, fragmentListDim - 1));
+        uint index = atomicCounterIncrement(fragmentCount);
+        if (index < fragmentCapacity) {
+            fragments[index] = uvec2(p.x | (p.y << 10) | (p.z << 20), packUnorm4x8(vec4(lighting, 1.0)));
+        }
+        return;
+    }
+
+    ivec3 dim = voxelFormat == 0 ? imageSize(voxelTexture) : imageSize(voxelRadiance);
+    ivec3 coord = ivec3(floor(dim * voxel));
+    if (any(lessThan(coord, regionMin)) || any(greaterThanEqual(coord, regionMax))) {
+        return;
+    }
+    ivec3 local = coord - regionMin;
+    coord = (coord + voxelOffset) % dim;
+    if (voxelFormat != 0) {
+        imageStore(voxelRadiance, coord, vec4(lighting, 1.0));
+        if (voxelFormat == 1) {
+            imageStore(opacityVolume, coord, vec4(1.0));
+        }
+        return;
+    }
+    writeVoxel(0, coord, local, lighting);
 }
@@ -0,0 +1,117 @@
+// Declarations and voxel writes shared by voxelization.frag and
+// voxelizeTriangles.comp, which voxelize the same way.
+
+uniform vec3 lightPosition;
+uniform vec3 lightColor;
+uniform vec3 worldCenter;
+uniform vec3 worldSizeHalf;
+uniform ivec3 regionMin; // only voxels in [regionMin, regionMax) are written
+uniform ivec3 regionMax;
+uniform ivec3 voxelOffset; // toroidal offset of the voxel grid
+
+// RGBA8 volumes viewed as packed uints so they can be written atomically
+layout(r32ui) coherent volatile uniform uimage3D voxelTexture;
+uniform sampler2D shadowMap;
+
+uniform int voxelTarget; // 0: voxel texture, 1: octree fragment list, 2: geometry volumes
+uniform int averageVoxels; // average all fragments of a voxel instead of keeping the last
+
+/* Floating point voxel formats, written directly as they cannot be averaged */
+uniform int voxelFormat; // 0: RGBA8, 1: R11G11B10F + R8 opacity, 2: RGBA16F
+layout(binding = 4) writeonly uniform image3D voxelRadiance;
+layout(binding = 5) writeonly uniform image3D opacityVolume;
+/* Floating point voxel formats */
+
+/* Geometry volumes, lit later by the light injection pass */
+layout(binding = 1, r32ui) coherent volatile uniform uimage3D albedoVolume;
+layout(binding = 2, r32ui) coherent volatile uniform uimage3D normalVolume;
+layout(binding = 3, r32ui) coherent volatile uniform uimage3D materialVolume;
+/* Geometry volumes */
+
+/* Averaged voxels, summed per channel in one slab of accumulationDepth slices
+   each: color, normal, fragment count */
+layout(binding = 6, r32ui) coherent uniform uimage3D accumulationVolume;
+uniform int accumulationDepth;
+const float FIXED_POINT_ONE = 4096.0; // fixed-point scale of the sums
+/* Averaged voxels */
+
+/* Octree fragment list */
+uniform int fragmentListDim;
+uniform uint fragmentCapacity;
+layout(binding = 0, offset = 0) uniform atomic_uint fragmentCount;
+layout(std430, binding = 0) writeonly buffer FragmentList { uvec2 fragments[]; };
+/* Octree fragment list */
+
+/* Material */
+uniform int hasShadows;
+uniform vec3 kd;
+uniform vec3 ke;
+uniform int materialId; // index of the material, stored by the geometry volumes
+uniform int hasDiffuseMap;
+uniform sampler2D diffuseMap;
+/* Material */
+
+float shadowCalculation(vec4 fragPosLightSpace, vec3 lightDir, vec3 normal) {
+    vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+    projCoords = projCoords * 0.5 + 0.5;
+    float currentDepth = projCoords.z;
+    float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);
+    float shadow = 0.0;
+    vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
+    for(int x = -1; x <= 1; ++x) {
+      for(int y = -1; y <= 1; ++y) {
+        float pcfDepth = textureLod(shadowMap, projCoords.xy + vec2(x, y) * texelSize, 0.0).r;
+        shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
+      }
+    }
+    shadow /= 9.0;
+
+    return shadow;
+}
+
+// Images cannot be passed to functions, so the volume is picked by index:
+// 0 voxel texture, 1 albedo, 2 normal.
+void imageStoreVolume(int volume, ivec3 coord, uint data) {
+    switch (volume) {
+    case 1:
+        imageStore(albedoVolume, coord, uvec4(data));
+        break;
+    case 2:
+        imageStore(normalVolume, coord, uvec4(data));
+        break;
+    default:
+        imageStore(voxelTexture, coord, uvec4(data));
+    }
+}
+
+void accumulate(int channel, ivec3 local, uint value) {
+    imageAtomicAdd(accumulationVolume, local + ivec3(0, 0, channel * accumulationDepth), value);
+}
+
+// Adds a value to the fixed-point sums of a voxel, at its position in the
+// region. Integer sums do not depend on the order of the fragments, the resolve
+// pass divides them by the count.
+void imageAtomicAverage(int volume, ivec3 local, vec3 value) {
+    uvec3 fixedValue = uvec3(round(clamp(value, 0.0, 1.0) * FIXED_POINT_ONE));
+    int first = volume == 2 ? 3 : 0;
+    for (int i = 0; i < 3; i++) {
+        accumulate(first + i, local, fixedValue[i]);
+    }
+    if (volume != 2) {
+        accumulate(6, local, 1u);
+    }
+}
+
+void writeVoxel(int volume, ivec3 coord, ivec3 local, vec3 value) {
+    if (averageVoxels == 1) {
+        imageAtomicAverage(volume, local, value);
+    } else {
+        imageStoreVolume(volume, coord, packUnorm4x8(vec4(value, 1.0)));
+    }
+}
+
+// Voxels shared by several materials keep the highest ID so that the result
+// does not depend on the order of the writes. Alpha marks the voxel as set.
+void writeMaterial(ivec3 coord) {
+    imageAtomicMax(materialVolume, coord, 0xFF000000u | uint(materialId));
+}
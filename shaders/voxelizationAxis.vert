@@ -0,0 +1,38 @@
+#version 440 core
+
+// Voxelization without a geometry shader. The triangles are drawn in batches
+// that share the dominant axis of their normal, so each vertex can be
+// projected along it on its own.
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNorm;
+layout (location = 2) in vec2 aTex;
+
+uniform mat4 M;
+uniform mat4 lightSpaceMatrix;
+uniform vec3 worldCenter;
+uniform vec3 worldSizeHalf;
+uniform int dominantAxis; // 0 x, 1 y, 2 z
+
+out vec3 worldPositionFrag;
+out vec3 normalFrag;
+out vec2 texCoordFrag;
+out vec4 lightSpacePosFrag;
+flat out vec4 triangleBounds; // unused, this path is never conservative
+
+void main() {
+    worldPositionFrag = vec3(M * vec4(aPos, 1.0));
+    normalFrag = transpose(inverse(mat3(M))) * aNorm;
+    lightSpacePosFrag = lightSpaceMatrix * vec4(worldPositionFrag, 1.0);
+    texCoordFrag = aTex;
+    triangleBounds = vec4(-1e10, -1e10, 1e10, 1e10);
+
+    // the same projection as voxelization.geom
+    vec3 outputPosition = (worldPositionFrag - worldCenter + worldSizeHalf) / max(worldSizeHalf.x, max(worldSizeHalf.y, worldSizeHalf.z)) - 1.0;
+    if (dominantAxis == 0) {
+        gl_Position = vec4(outputPosition.zy, 1.0, 1.0);
+    } else if (dominantAxis == 1) {
+        gl_Position = vec4(outputPosition.xz, 1.0, 1.0);
+    } else {
+        gl_Position = vec4(outputPosition.xy, 1.0, 1.0);
+    }
+}
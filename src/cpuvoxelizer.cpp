@@ -0,0 +1,417 @@
+#include "cpuvoxelizer.h"
+#include "constants.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bilinear lookup of one level of an image, wrapping around its edges like
+// GL_REPEAT. Single channel images return their value in red, like GL_RED.
+static glm::vec3 sampleLevel(const Image &image, int level, glm::vec2 uv) {
+  int w = std::max(image.width >> level, 1);
+  int h = std::max(image.height >> level, 1);
+  const std::vector<unsigned char> &texels = image.levels[level];
+  float u = uv.x * w - 0.5f, v = uv.y * h - 0.5f;
+  int x0 = (int)std::floor(u), y0 = (int)std::floor(v);
+  float fx = u - x0, fy = v - y0;
+
+  glm::vec3 color(0.0f);
+  for (int i = 0; i < 4; i++) {
+    int x = ((x0 + (i & 1)) % w + w) % w;
+    int y = ((y0 + (i >> 1)) % h + h) % h;
+    float weight = ((i & 1) ? fx : 1.0f - fx) * ((i >> 1) ? fy : 1.0f - fy);
+    const unsigned char *texel =
+        &texels[((size_t)y * w + x) * image.channels];
+    glm::vec3 value(texel[0], 0.0f, 0.0f);
+    if (image.channels > 1)
+      value = glm::vec3(texel[0], texel[1], texel[2]);
+    color += weight * value;
+  }
+  return color / 255.0f;
+}
+
+// Trilinear lookup of an image, lod is the mip level as a real number.
+static glm::vec3 sampleImage(const Image &image, glm::vec2 uv, float lod) {
+  int last = image.levels.size() - 1;
+  lod = glm::clamp(lod, 0.0f, (float)last);
+  int level = (int)lod;
+  glm::vec3 color = sampleLevel(image, level, uv);
+  if (level == last)
+    return color;
+  return glm::mix(color, sampleLevel(image, level + 1, uv), lod - level);
+}
+
+CpuVoxelizer::CpuVoxelizer(Scene &_scene, glm::ivec3 _gridDim)
+    : scene(_scene), gridDim(_gridDim), voxelizeTime(0.0f) {
+  // Same placement as the dense grid of VoxelMap.
+  voxelSize = scene.getWorldSize() / VOXEL_DIM;
+  gridMin = scene.getWorldCenter() - 0.5f * voxelSize * glm::vec3(gridDim);
+  slabBricks = (glm::ivec2(gridDim) + BRICK_DIM - 1) / BRICK_DIM;
+  threadCount = std::max((int)std::thread::hardware_concurrency(), 1);
+}
+
+// Runs work(thread, item) for every item in [0, count) on all threads, the
+// items are handed out in order as the threads become free.
+void CpuVoxelizer::parallelFor(int count,
+                               const std::function<void(int, int)> &work) {
+  std::atomic<int> nextItem(0);
+  std::function<void(int)> worker = [&](int thread) {
+    for (int item = nextItem++; item < count; item = nextItem++)
+      work(thread, item);
+  };
+
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < threadCount; thread++)
+    threads.push_back(std::thread(worker, thread));
+  worker(0);
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+void CpuVoxelizer::voxelize() {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  size_t texels = (size_t)gridDim.x * gridDim.y * gridDim.z;
+  for (int i = 0; i < 3; i++)
+    volumes[i].assign(4 * texels, 0);
+  binTriangles();
+
+  std::vector<SlabScratch> scratch(threadCount);
+  parallelFor(slabTriangles.size(), [&](int thread, int slab) {
+    voxelizeSlab(slab, scratch[thread]);
+  });
+  slabTriangles.clear();
+
+  std::chrono::duration<float, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  voxelizeTime = elapsed.count();
+}
+
+// Lists the static triangles each slab has to voxelize.
+void CpuVoxelizer::binTriangles() {
+  int slabCount = (gridDim.z + BRICK_DIM - 1) / BRICK_DIM;
+  slabTriangles.assign(slabCount, std::vector<TriangleRef>());
+
+  const std::vector<Mesh> &meshes = scene.getMeshes();
+  for (size_t m = 0; m < meshes.size(); m++) {
+    const Mesh &mesh = meshes[m];
+    if (mesh.isDynamic)
+      continue;
+    for (int t = 0; t < mesh.numTriangles; t++) {
+      const GLfloat *vertex = &mesh.vertices[3 * t * mesh.stride];
+      float zMin = FLT_MAX, zMax = -FLT_MAX;
+      for (int k = 0; k < 3; k++) {
+        zMin = std::min(zMin, vertex[k * mesh.stride + 2]);
+        zMax = std::max(zMax, vertex[k * mesh.stride + 2]);
+      }
+      int first = (int)std::floor((zMin - gridMin.z) / voxelSize) / BRICK_DIM;
+      int last = (int)std::floor((zMax - gridMin.z) / voxelSize) / BRICK_DIM;
+      first = std::max(first, 0);
+      last = std::min(last, slabCount - 1);
+      TriangleRef ref = {(int)m, t};
+      for (int slab = first; slab <= last; slab++)
+        slabTriangles[slab].push_back(ref);
+    }
+  }
+}
+
+void CpuVoxelizer::voxelizeSlab(int slab, SlabScratch &scratch) {
+  size_t bricks = (size_t)slabBricks.x * slabBricks.y;
+  if (scratch.sums.empty()) {
+    VoxelSum empty = {glm::vec3(0.0f), glm::vec3(0.0f), 0, 0};
+    scratch.sums.assign(bricks * BRICK_DIM * BRICK_DIM * BRICK_DIM, empty);
+    scratch.brickTouched.assign(bricks, 0);
+  }
+
+  const std::vector<TriangleRef> &triangles = slabTriangles[slab];
+  for (size_t i = 0; i < triangles.size(); i++)
+    voxelizeTriangle(triangles[i], slab, scratch);
+  resolveSlab(slab, scratch);
+}
+
+// Sets up the separating axes of a triangle given in voxel space. Returns
+// false for degenerate triangles, which the rasterizer drops as well.
+bool CpuVoxelizer::setupAxes(const glm::vec3 *p, TriangleAxes &axes) {
+  glm::vec3 edges[3] = {p[1] - p[0], p[2] - p[1], p[0] - p[2]};
+  glm::vec3 normal = glm::cross(edges[0], edges[1]);
+  if (glm::dot(normal, normal) == 0.0f)
+    return false;
+
+  for (int i = 0; i < SAT_AXES; i++) {
+    glm::vec3 axis = normal;
+    if (i > 0) {
+      glm::vec3 boxAxis(0.0f);
+      boxAxis[(i - 1) % 3] = 1.0f;
+      axis = glm::cross(boxAxis, edges[(i - 1) / 3]);
+    }
+    float p0 = glm::dot(p[0], axis);
+    float p1 = glm::dot(p[1], axis);
+    float p2 = glm::dot(p[2], axis);
+    float projMin = std::min(p0, std::min(p1, p2));
+    float projMax = std::max(p0, std::max(p1, p2));
+    float radius = 0.5f * (std::abs(axis.x) + std::abs(axis.y) +
+                           std::abs(axis.z));
+    axes.x[i] = axis.x;
+    axes.y[i] = axis.y;
+    axes.z[i] = axis.z;
+    axes.mid[i] = 0.5f * (projMin + projMax);
+    axes.extent[i] = 0.5f * (projMax - projMin) + radius;
+  }
+  return true;
+}
+
+// Tests the four voxels starting at x of a row against a triangle, bit i of
+// the result is set if voxel x + i overlaps it.
+int CpuVoxelizer::overlapRow(const TriangleAxes &axes, int x, float y,
+                             float z) {
+#ifdef __SSE2__
+  __m128 centerX = _mm_add_ps(_mm_set1_ps(x + 0.5f),
+                              _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+  __m128 signMask = _mm_set1_ps(-0.0f);
+  __m128 inside = _mm_cmpeq_ps(centerX, centerX);
+  for (int i = 0; i < SAT_AXES; i++) {
+    float rowOffset = y * axes.y[i] + z * axes.z[i] - axes.mid[i];
+    __m128 distance = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(axes.x[i])),
+                                 _mm_set1_ps(rowOffset));
+    distance = _mm_andnot_ps(signMask, distance);
+    inside = _mm_and_ps(
+        inside, _mm_cmple_ps(distance, _mm_set1_ps(axes.extent[i])));
+  }
+  return _mm_movemask_ps(inside);
+#else
+  int mask = 0;
+  for (int lane = 0; lane < 4; lane++) {
+    float centerX = x + lane + 0.5f;
+    bool inside = true;
+    for (int i = 0; i < SAT_AXES && inside; i++) {
+      float distance = centerX * axes.x[i] + y * axes.y[i] + z * axes.z[i];
+      inside = std::abs(distance - axes.mid[i]) <= axes.extent[i];
+    }
+    mask |= inside << lane;
+  }
+  return mask;
+#endif
+}
+
+// Adds a triangle to the voxels of a slab it overlaps. Every voxel is shaded
+// at the point of the triangle closest to its center.
+void CpuVoxelizer::voxelizeTriangle(TriangleRef ref, int slab,
+                                    SlabScratch &scratch) {
+  const Mesh &mesh = scene.getMeshes()[ref.mesh];
+  const Material &material = scene.getMaterial(mesh.materialId);
+  const GLfloat *vertex = &mesh.vertices[3 * ref.triangle * mesh.stride];
+
+  glm::vec3 p[3], n[3];
+  glm::vec2 uv[3];
+  for (int k = 0; k < 3; k++) {
+    const GLfloat *v = vertex + k * mesh.stride;
+    p[k] = (glm::vec3(v[0], v[1], v[2]) - gridMin) / voxelSize;
+    n[k] = glm::vec3(v[3], v[4], v[5]);
+    uv[k] = glm::vec2(v[6], v[7]);
+  }
+
+  TriangleAxes axes;
+  if (!setupAxes(p, axes))
+    return;
+
+  glm::ivec3 slabMin(0, 0, slab * BRICK_DIM);
+  glm::ivec3 slabMax(gridDim.x, gridDim.y,
+                     std::min(slabMin.z + BRICK_DIM, gridDim.z));
+  glm::ivec3 coordMin = glm::max(
+      glm::ivec3(glm::floor(glm::min(p[0], glm::min(p[1], p[2])))), slabMin);
+  glm::ivec3 coordMax =
+      glm::min(glm::ivec3(glm::floor(glm::max(p[0], glm::max(p[1], p[2])))),
+               slabMax - 1);
+  if (glm::any(glm::greaterThan(coordMin, coordMax)))
+    return;
+
+  // The texture is sampled at the level the rasterizer would pick, from the
+  // texels per voxel of the triangle projected along its dominant axis.
+  const Image *image = NULL;
+  float lod = 0.0f;
+  if (material.diffuseImage >= 0) {
+    image = &scene.getImage(material.diffuseImage);
+    glm::vec2 uvEdge1 = uv[1] - uv[0], uvEdge2 = uv[2] - uv[0];
+    float uvArea = std::abs(uvEdge1.x * uvEdge2.y - uvEdge1.y * uvEdge2.x);
+    glm::vec3 normal = glm::abs(glm::cross(p[1] - p[0], p[2] - p[0]));
+    float projectedArea = std::max(normal.x, std::max(normal.y, normal.z));
+    lod = 0.5f * std::log2(std::max(
+                     uvArea * image->width * image->height / projectedArea,
+                     1e-8f));
+  }
+
+  glm::vec3 edge1 = p[1] - p[0], edge2 = p[2] - p[0];
+  float d11 = glm::dot(edge1, edge1), d12 = glm::dot(edge1, edge2);
+  float d22 = glm::dot(edge2, edge2);
+  float denominator = d11 * d22 - d12 * d12;
+
+  for (int z = coordMin.z; z <= coordMax.z; z++) {
+    for (int y = coordMin.y; y <= coordMax.y; y++) {
+      for (int x = coordMin.x; x <= coordMax.x; x += 4) {
+        int mask = overlapRow(axes, x, y + 0.5f, z + 0.5f);
+        for (int lane = 0; lane < 4 && x + lane <= coordMax.x; lane++) {
+          if (!(mask & (1 << lane)))
+            continue;
+          glm::ivec3 coord(x + lane, y, z);
+
+          // barycentrics of the center projected onto the triangle plane,
+          // clamped into the triangle
+          glm::vec3 offset = glm::vec3(coord) + 0.5f - p[0];
+          float d1 = glm::dot(offset, edge1), d2 = glm::dot(offset, edge2);
+          float b1 = std::max((d22 * d1 - d12 * d2) / denominator, 0.0f);
+          float b2 = std::max((d11 * d2 - d12 * d1) / denominator, 0.0f);
+          float b0 = std::max(1.0f - b1 - b2, 0.0f);
+          float sum = b0 + b1 + b2;
+          b0 /= sum;
+          b1 /= sum;
+          b2 /= sum;
+
+          glm::vec3 color = material.kd;
+          if (image) {
+            color =
+                sampleImage(*image, b0 * uv[0] + b1 * uv[1] + b2 * uv[2], lod);
+          }
+          glm::vec3 normal = b0 * n[0] + b1 * n[1] + b2 * n[2];
+          if (glm::dot(normal, normal) > 0.0f)
+            normal = glm::normalize(normal);
+
+          glm::ivec3 local = coord - slabMin;
+          int brick =
+              local.x / BRICK_DIM + slabBricks.x * (local.y / BRICK_DIM);
+          glm::ivec3 inBrick = local % BRICK_DIM;
+          VoxelSum &voxel =
+              scratch.sums[brick * BRICK_DIM * BRICK_DIM * BRICK_DIM +
+                           inBrick.x + BRICK_DIM * inBrick.y +
+                           BRICK_DIM * BRICK_DIM * inBrick.z];
+          voxel.albedo += color;
+          voxel.normal += 0.5f * normal + 0.5f;
+          voxel.material = std::max(voxel.material, (int)mesh.materialId);
+          voxel.count++;
+          if (!scratch.brickTouched[brick]) {
+            scratch.brickTouched[brick] = 1;
+            scratch.touchedBricks.push_back(brick);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Writes the averages of the voxels of a slab to the volumes and clears the
+// sums for the next slab.
+void CpuVoxelizer::resolveSlab(int slab, SlabScratch &scratch) {
+  const int brickVoxels = BRICK_DIM * BRICK_DIM * BRICK_DIM;
+  VoxelSum empty = {glm::vec3(0.0f), glm::vec3(0.0f), 0, 0};
+
+  for (size_t i = 0; i < scratch.touchedBricks.size(); i++) {
+    int brick = scratch.touchedBricks[i];
+    glm::ivec3 brickMin(brick % slabBricks.x * BRICK_DIM,
+                        brick / slabBricks.x * BRICK_DIM, slab * BRICK_DIM);
+    for (int v = 0; v < brickVoxels; v++) {
+      VoxelSum &voxel = scratch.sums[brick * brickVoxels + v];
+      if (voxel.count == 0)
+        continue;
+      glm::ivec3 coord = brickMin + glm::ivec3(v % BRICK_DIM,
+                                               v / BRICK_DIM % BRICK_DIM,
+                                               v / (BRICK_DIM * BRICK_DIM));
+      size_t index =
+          4 * (coord.x + gridDim.x * ((size_t)coord.y + gridDim.y * coord.z));
+      glm::vec3 values[2] = {voxel.albedo, voxel.normal};
+      for (int j = 0; j < 2; j++) {
+        glm::vec3 average = glm::clamp(values[j] / (float)voxel.count, 0.0f,
+                                       1.0f);
+        for (int c = 0; c < 3; c++) {
+          volumes[j][index + c] =
+              (unsigned char)std::round(255.0f * average[c]);
+        }
+        volumes[j][index + 3] = 255;
+      }
+      // the material ID is stored in the color bytes, like on the GPU
+      for (int c = 0; c < 3; c++)
+        volumes[2][index + c] = (unsigned char)(voxel.material >> (8 * c));
+      volumes[2][index + 3] = 255;
+      voxel = empty;
+    }
+    scratch.brickTouched[brick] = 0;
+  }
+  scratch.touchedBricks.clear();
+}
+
+// Builds the mip chain of a volume the way voxelMipmap.comp does, level 0 is
+// the volume itself.
+std::vector<std::vector<unsigned char>>
+CpuVoxelizer::buildMipmaps(int volume, MipmapFilter filter, int levels) {
+  std::vector<std::vector<unsigned char>> mips(1, volumes[volume]);
+  glm::ivec3 sourceDim = gridDim;
+  for (int level = 1; level < levels; level++) {
+    glm::ivec3 dim = glm::max(gridDim >> level, 1);
+    const std::vector<unsigned char> &source = mips.back();
+    std::vector<unsigned char> mip(4 * (size_t)dim.x * dim.y * dim.z);
+
+    parallelFor(dim.z, [&](int thread, int z) {
+      for (int y = 0; y < dim.y; y++) {
+        for (int x = 0; x < dim.x; x++) {
+          // box filter over the 2x2x2 footprint, children outside the
+          // source are empty
+          glm::vec4 value(0.0f);
+          for (int i = 0; i < 8; i++) {
+            glm::ivec3 child = 2 * glm::ivec3(x, y, z) +
+                               glm::ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+            if (glm::any(glm::greaterThanEqual(child, sourceDim)))
+              continue;
+            const unsigned char *texel =
+                &source[4 * (child.x +
+                             sourceDim.x *
+                                 ((size_t)child.y + sourceDim.y * child.z))];
+            glm::vec4 childValue =
+                glm::vec4(texel[0], texel[1], texel[2], texel[3]) / 255.0f;
+            if (filter == MipmapFilter::OPACITY_WEIGHTED)
+              childValue = glm::vec4(glm::vec3(childValue) * childValue.a,
+                                     childValue.a);
+            value += childValue;
+          }
+          if (filter == MipmapFilter::OPACITY_WEIGHTED && value.a > 0.0f)
+            value = glm::vec4(glm::vec3(value) * 8.0f / value.a, value.a);
+          value = glm::clamp(value / 8.0f, 0.0f, 1.0f);
+
+          size_t index = 4 * (x + dim.x * ((size_t)y + dim.y * z));
+          for (int c = 0; c < 4; c++)
+            mip[index + c] = (unsigned char)std::round(255.0f * value[c]);
+        }
+      }
+    });
+    mips.push_back(mip);
+    sourceDim = dim;
+  }
+  return mips;
+}
+
+VolumeComparison
+CpuVoxelizer::compare(const std::vector<unsigned char> &first,
+                      const std::vector<unsigned char> &second) {
+  VolumeComparison result = {0, 0, 0, 0.0f, 0};
+  double errorSum = 0.0;
+  for (size_t i = 0; i + 3 < first.size() && i + 3 < second.size(); i += 4) {
+    bool inFirst = first[i + 3] != 0, inSecond = second[i + 3] != 0;
+    if (inFirst && !inSecond) {
+      result.onlyFirst++;
+    } else if (inSecond && !inFirst) {
+      result.onlySecond++;
+    } else if (inFirst && inSecond) {
+      result.matching++;
+      for (int c = 0; c < 3; c++) {
+        int error = std::abs(first[i + c] - second[i + c]);
+        errorSum += error;
+        result.maxError = std::max(result.maxError, error);
+      }
+    }
+  }
+  if (result.matching > 0)
+    result.meanError = errorSum / (3.0 * result.matching);
+  return result;
+}
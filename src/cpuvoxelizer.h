@@ -0,0 +1,94 @@
+#ifndef CPU_VOXELIZER_H
+#define CPU_VOXELIZER_H
+
+#include "scene.h"
+#include "utils.h"
+#include "voxelmap.h"
+
+#include <functional>
+#include <vector>
+
+// Differences between two RGBA8 volumes of the same size, a voxel is occupied
+// if its alpha is not zero.
+struct VolumeComparison {
+  size_t matching;   // occupied in both volumes
+  size_t onlyFirst;  // occupied in the first volume only
+  size_t onlySecond; // occupied in the second volume only
+  float meanError;   // color difference of the voxels occupied in both, in
+  int maxError;      // 8 bit steps
+};
+
+// Voxelizes the static meshes of a scene on the CPU into the albedo, normal
+// and material volumes VoxelMap::voxelizeStatic writes on the GPU, so voxel
+// data can be checked and baked on machines without a GPU. A voxel is written
+// if a triangle overlaps its box, like conservative voxelization, and
+// averages all the triangles that do. It keeps the highest material ID of
+// them.
+class CpuVoxelizer {
+private:
+  // The grid is voxelized in slabs one brick deep along z, handed out to the
+  // threads one at a time. Inside a slab the sums are stored in bricks of
+  // BRICK_DIM^3 voxels so the few voxels a triangle touches are close.
+  static const int BRICK_DIM = 4;
+  static const int SAT_AXES = 10; // triangle normal and the 9 edge axes
+
+  struct TriangleRef {
+    int mesh;
+    int triangle;
+  };
+  struct VoxelSum {
+    glm::vec3 albedo, normal;
+    int material;
+    int count;
+  };
+  // Per thread sums of the current slab and the bricks written so far.
+  struct SlabScratch {
+    std::vector<VoxelSum> sums;
+    std::vector<char> brickTouched;
+    std::vector<int> touchedBricks;
+  };
+  // Separating axes of a triangle in voxel space. A voxel with center c
+  // overlaps the triangle if |dot(c, axis) - mid| <= extent on every axis,
+  // the box face axes are covered by the bounds of the triangle.
+  struct TriangleAxes {
+    float x[SAT_AXES], y[SAT_AXES], z[SAT_AXES];
+    float mid[SAT_AXES], extent[SAT_AXES];
+  };
+
+  Scene &scene;
+  glm::ivec3 gridDim;
+  glm::vec3 gridMin;
+  float voxelSize;
+  glm::ivec2 slabBricks; // bricks along x and y
+  int threadCount;
+  float voxelizeTime; // wall time of the last voxelization, in ms
+  std::vector<unsigned char> volumes[3]; // RGBA8, x varying fastest
+  std::vector<std::vector<TriangleRef>> slabTriangles;
+
+  void parallelFor(int count, const std::function<void(int, int)> &work);
+  void binTriangles();
+  void voxelizeSlab(int slab, SlabScratch &scratch);
+  void voxelizeTriangle(TriangleRef ref, int slab, SlabScratch &scratch);
+  bool setupAxes(const glm::vec3 *p, TriangleAxes &axes);
+  int overlapRow(const TriangleAxes &axes, int x, float y, float z);
+  void resolveSlab(int slab, SlabScratch &scratch);
+
+public:
+  CpuVoxelizer(Scene &_scene, glm::ivec3 _gridDim);
+
+  void voxelize();
+  std::vector<std::vector<unsigned char>>
+  buildMipmaps(int volume, MipmapFilter filter, int levels);
+  // Voxelized volume: 0 albedo, 1 normal, 2 material.
+  const std::vector<unsigned char> &getVolume(int volume) {
+    return volumes[volume];
+  }
+  glm::ivec3 getGridDim() { return gridDim; }
+  float getVoxelizeTime() { return voxelizeTime; }
+  int getThreadCount() { return threadCount; }
+
+  static VolumeComparison compare(const std::vector<unsigned char> &first,
+                                  const std::vector<unsigned char> &second);
+};
+
+#endif /* ifndef CPU_VOXELIZER_H */
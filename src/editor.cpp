@@ -48,11 +48,11 @@ void Editor::renderEditor() {
     ImGui::SliderFloat("z", glm::value_ptr(lightPosition) + 2, -500.0f, 500.0f);
     if (ImGui::IsItemEdited()) {
       regenShadowMap = true;
-      revoxelize = true;
+      relight = true;
     }
     ImGui::ColorEdit3("Color", glm::value_ptr(lightColor));
     if (ImGui::IsItemEdited()) {
-      revoxelize = true;
+      relight = true;
     }
   }
 
@@ -64,13 +64,13 @@ void Editor::renderEditor() {
     if (ImGui::RadioButton("GI", engineMode == EngineMode::RENDER)) {
       engineMode = EngineMode::RENDER;
       hasShadows = true;
-      revoxelize = true;
+      relight = true;
     }
     if (engineMode == EngineMode::VISUALIZE) {
       ImGui::Separator();
       ImGui::Checkbox("Shadows", &hasShadows);
       if (ImGui::IsItemEdited()) {
-        revoxelize = true;
+        relight = true;
       }
     } else {
       ImGui::Separator();
@@ -79,20 +79,170 @@ void Editor::renderEditor() {
     }
 
     ImGui::Separator();
-    ImGui::Text("Voxel Map Resolution");
-    const char resolutionLabels[100] = "x512\0x256\0x128\0x64";
-    if (ImGui::Combo("", &voxelRes, resolutionLabels)) {
+    ImGui::Text("Voxel Backend");
+    if (ImGui::RadioButton("Dense",
+                           voxelmap.getBackend() == VoxelBackend::DENSE)) {
+      voxelmap.setBackend(VoxelBackend::DENSE);
+      revoxelize = true;
+    }
+    if (ImGui::RadioButton("Sparse octree",
+                           voxelmap.getBackend() == VoxelBackend::OCTREE)) {
+      voxelmap.setBackend(VoxelBackend::OCTREE);
+      revoxelize = true;
+    }
+    if (ImGui::RadioButton("Clipmap",
+                           voxelmap.getBackend() == VoxelBackend::CLIPMAP)) {
+      voxelmap.setBackend(VoxelBackend::CLIPMAP);
+      revoxelize = true;
+    }
+    if (voxelmap.getOctreeFull()) {
+      ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f),
+                         "Scene too large for the octree pools");
+    }
+
+    bool axisBinned = voxelmap.getVoxelizePath() == VoxelizePath::AXIS_BINNED;
+    if (ImGui::Checkbox("Voxelize without geometry shader", &axisBinned)) {
+      voxelmap.setVoxelizePath(axisBinned ? VoxelizePath::AXIS_BINNED
+                                          : VoxelizePath::GEOMETRY_SHADER);
+      revoxelize = true;
+    }
+    bool conservative = voxelmap.getConservative();
+    if (ImGui::Checkbox("Conservative voxelization", &conservative)) {
+      voxelmap.setConservative(conservative);
       revoxelize = true;
-      if (voxelRes == 0)
-        VOXEL_DIM = 512;
-      if (voxelRes == 1)
-        VOXEL_DIM = 256;
-      if (voxelRes == 2)
-        VOXEL_DIM = 128;
-      if (voxelRes == 3)
-        VOXEL_DIM = 64;
-      voxelmap.resizeTexture();
     }
+    bool hybridVoxelize = voxelmap.getHybridVoxelize();
+    if (ImGui::Checkbox("Voxelize small triangles in compute",
+                        &hybridVoxelize)) {
+      voxelmap.setHybridVoxelize(hybridVoxelize);
+      revoxelize = true;
+    }
+    ImGui::Text("Voxelization: %.2f ms", voxelmap.getVoxelizeTime());
+
+    // The octree builds its leaves from a fragment list instead, and the
+    // floating point formats cannot be averaged atomically.
+    if (voxelmap.getBackend() != VoxelBackend::OCTREE &&
+        (voxelmap.getBackend() != VoxelBackend::DENSE ||
+         voxelmap.getVoxelFormat() == VoxelFormat::RGBA8)) {
+      bool averageVoxels = voxelmap.getAverageVoxels();
+      if (ImGui::Checkbox("Average voxel fragments", &averageVoxels)) {
+        voxelmap.setAverageVoxels(averageVoxels);
+        revoxelize = true;
+      }
+    }
+
+    if (voxelmap.getBackend() == VoxelBackend::DENSE) {
+      ImGui::Text("Voxel Map Resolution");
+      // The lower resolutions are mips of the fitted grid, switching needs
+      // no voxelization.
+      char resolutionLabels[4][64];
+      const char *resolutionItems[4];
+      for (int i = 0; i < 4; i++) {
+        glm::ivec3 gridDim = glm::max(voxelmap.getGridDim() >> i, 1);
+        snprintf(resolutionLabels[i], sizeof(resolutionLabels[i]), "%dx%dx%d",
+                 gridDim.x, gridDim.y, gridDim.z);
+        resolutionItems[i] = resolutionLabels[i];
+      }
+      if (ImGui::Combo("", &voxelRes, resolutionItems, 4))
+        voxelmap.setResolutionLevel(voxelRes);
+      ImGui::Text("Voxel Format");
+      const char *formatNames[3] = {"RGBA8", "R11G11B10F + R8", "RGBA16F"};
+      char formatLabels[3][64];
+      const char *formatItems[3];
+      for (int i = 0; i < 3; i++) {
+        snprintf(formatLabels[i], sizeof(formatLabels[i]), "%s (%.0f MB)",
+                 formatNames[i],
+                 voxelmap.getDenseMemoryUsage((VoxelFormat)i) /
+                     (1024.0f * 1024.0f));
+        formatItems[i] = formatLabels[i];
+      }
+      int voxelFormat = (int)voxelmap.getVoxelFormat();
+      if (ImGui::Combo("##voxelFormat", &voxelFormat, formatItems, 3)) {
+        voxelmap.setVoxelFormat((VoxelFormat)voxelFormat);
+        revoxelize = true;
+      }
+      ImGui::Text("Mip Filter");
+      int mipmapFilter = (int)voxelmap.getMipmapFilter();
+      const char filterLabels[100] = "Box\0Opacity weighted";
+      if (ImGui::Combo("##mipmapFilter", &mipmapFilter, filterLabels)) {
+        voxelmap.setMipmapFilter((MipmapFilter)mipmapFilter);
+        voxelmap.updateMipmaps();
+      }
+      bool anisotropic = voxelmap.getAnisotropic();
+      if (ImGui::Checkbox("Anisotropic mips", &anisotropic))
+        voxelmap.setAnisotropic(anisotropic);
+      // The specular cone skips the space a distance field shows to be empty.
+      bool skipEmptySpace = voxelmap.getSkipEmptySpace();
+      if (ImGui::Checkbox("Skip empty space", &skipEmptySpace))
+        voxelmap.setSkipEmptySpace(skipEmptySpace);
+      // The voxels are lit again a few slices a frame with the light they
+      // gather from the volume, turning it off relights them directly.
+      bool multiBounce = voxelmap.getMultiBounce();
+      if (ImGui::Checkbox("Multiple bounces", &multiBounce)) {
+        voxelmap.setMultiBounce(multiBounce);
+        relight = true;
+      }
+      if (multiBounce) {
+        int bounceSlices = voxelmap.getBounceSlices();
+        if (ImGui::SliderInt("Bounce slices per frame", &bounceSlices, 1, 64))
+          voxelmap.setBounceSlices(bounceSlices);
+      }
+      // Diffuse cones can be traced per 4^3 voxels or per probe over a few
+      // frames instead of per fragment.
+      ImGui::Text("Diffuse Light");
+      int diffuseCache = (int)voxelmap.getDiffuseCache();
+      const char cacheLabels[100] = "Cones\0Irradiance cache\0Probe grid";
+      if (ImGui::Combo("##diffuseCache", &diffuseCache, cacheLabels))
+        voxelmap.setDiffuseCache((DiffuseCache)diffuseCache);
+      if (voxelmap.getDiffuseCache() == DiffuseCache::VOXELS) {
+        int irradianceSlices = voxelmap.getIrradianceSlices();
+        if (ImGui::SliderInt("Slices per frame", &irradianceSlices, 1, 32))
+          voxelmap.setIrradianceSlices(irradianceSlices);
+      }
+      if (voxelmap.getDiffuseCache() == DiffuseCache::PROBES) {
+        int probeSpacing = voxelmap.getProbeSpacing();
+        if (ImGui::SliderInt("Spacing (voxels)", &probeSpacing, 4, 64))
+          voxelmap.setProbeSpacing(probeSpacing);
+        glm::ivec3 probeDim = voxelmap.getProbeDim();
+        ImGui::Text("Probes %dx%dx%d", probeDim.x, probeDim.y, probeDim.z);
+        int probesPerFrame = voxelmap.getProbesPerFrame();
+        if (ImGui::SliderInt("Probes per frame", &probesPerFrame, 64, 8192))
+          voxelmap.setProbesPerFrame(probesPerFrame);
+        bool probeVisibility = voxelmap.getProbeVisibility();
+        if (ImGui::Checkbox("Probe visibility", &probeVisibility))
+          voxelmap.setProbeVisibility(probeVisibility);
+      }
+      // Moving the bunny then only relights its own small volume.
+      bool rigidProxy = voxelmap.getRigidProxy();
+      if (ImGui::Checkbox("Object space proxy for the bunny", &rigidProxy)) {
+        voxelmap.setRigidProxy(rigidProxy);
+        revoxelize = true;
+      }
+      // Rebuilds happen in a second set of volumes over a few frames.
+      bool doubleBuffered = voxelmap.getDoubleBuffered();
+      if (ImGui::Checkbox("Double buffered volumes", &doubleBuffered))
+        voxelmap.setDoubleBuffered(doubleBuffered);
+      if (doubleBuffered) {
+        // Rebuilds spend at most this much GPU time a frame.
+        float rebuildBudget = voxelmap.getRebuildBudget();
+        if (ImGui::SliderFloat("Budget (ms)", &rebuildBudget, 0.0f, 16.0f))
+          voxelmap.setRebuildBudget(rebuildBudget);
+      }
+      if (voxelmap.isRebuilding()) {
+        ImGui::Text("Rebuilding voxels: %.0f%%",
+                    100.0f * voxelmap.getRebuildProgress());
+      }
+    } else if (voxelmap.getBackend() == VoxelBackend::CLIPMAP) {
+      ImGui::Text("%d levels of x%d", voxelmap.getClipmapLevels(),
+                  voxelmap.getClipmapDim());
+    } else {
+      VoxelOctree &octree = voxelmap.getOctree();
+      ImGui::Text("Octree x%d", octree.getDim());
+      ImGui::Text("Nodes %.1f%%, bricks %.1f%%", 100.0f * octree.getNodeUsage(),
+                  100.0f * octree.getBrickUsage());
+    }
+    ImGui::Text("Voxel memory: %.1f MB",
+                voxelmap.getMemoryUsage() / (1024.0f * 1024.0f));
 
     ImGui::Separator();
     ImGui::Text("%.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
@@ -108,7 +258,7 @@ void Editor::renderEditor() {
       ImGui::SliderFloat("Emissive", &floorEmissive, 0.0f, 1.0f);
       if (ImGui::IsItemEdited()) {
         floorEmissiveRef = glm::vec3(floorEmissive);
-        revoxelize = true;
+        editedMaterials.push_back(scene.getFloorMaterialId());
       }
       ImGui::TreePop();
     }
@@ -120,7 +270,7 @@ void Editor::renderEditor() {
       ImGui::SliderFloat("Emissive", &curtainEmissive, 0.0f, 1.0f);
       if (ImGui::IsItemEdited()) {
         curtainEmissiveRef = glm::vec3(curtainEmissive);
-        revoxelize = true;
+        editedMaterials.push_back(scene.getCurtainMaterialId());
       }
       ImGui::TreePop();
     }
@@ -130,19 +280,16 @@ void Editor::renderEditor() {
                          -200.0f, 200.0f);
       if (ImGui::IsItemEdited()) {
         regenShadowMap = true;
-        revoxelize = true;
       }
       ImGui::SliderFloat("y", glm::value_ptr(scene.dynamicMeshPosition) + 1,
                          -200.0f, 200.0f);
       if (ImGui::IsItemEdited()) {
         regenShadowMap = true;
-        revoxelize = true;
       }
       ImGui::SliderFloat("z", glm::value_ptr(scene.dynamicMeshPosition) + 2,
                          -200.0f, 200.0f);
       if (ImGui::IsItemEdited()) {
         regenShadowMap = true;
-        revoxelize = true;
       }
       ImGui::SliderFloat("Specular", &dynamicSpecular, 0.0f, 1.0f);
       if (ImGui::IsItemEdited()) {
@@ -151,7 +298,7 @@ void Editor::renderEditor() {
       ImGui::SliderFloat("Emissive", &dynamicEmissive, 0.0f, 2.0f);
       if (ImGui::IsItemEdited()) {
         dynamicEmissiveRef = glm::vec3(dynamicEmissive);
-        revoxelize = true;
+        editedMaterials.push_back(scene.getDynamicMaterialId());
       }
       ImGui::TreePop();
     }
@@ -165,10 +312,41 @@ void Editor::renderScene() {
     shadowMap.generate(scene, lightPosition);
     regenShadowMap = false;
   }
+  voxelmap.updateClipmap(camera.position, lightPosition, lightColor,
+                         hasShadows);
   if (revoxelize) {
     voxelmap.voxelize(lightPosition, lightColor, hasShadows);
+    voxelizedDynamicPosition = scene.dynamicMeshPosition;
     revoxelize = false;
+    relight = false;
+    editedMaterials.clear();
+  } else if (relight) {
+    // The geometry is unchanged, only the light has to be injected again.
+    voxelmap.relight(lightPosition, lightColor, hasShadows);
+    voxelizedDynamicPosition = scene.dynamicMeshPosition;
+    relight = false;
+    editedMaterials.clear();
+  } else if (scene.dynamicMeshPosition != voxelizedDynamicPosition) {
+    // Only revoxelize the space the bunny moved through and relight the
+    // static voxels its old and new shadows fall on. The shadow map looks
+    // from the light at the origin.
+    glm::vec3 oldMin, oldMax, newMin, newMax;
+    scene.getDynamicShadowBounds(voxelizedDynamicPosition, -lightPosition,
+                                 oldMin, oldMax);
+    scene.getDynamicShadowBounds(scene.dynamicMeshPosition, -lightPosition,
+                                 newMin, newMax);
+    voxelmap.voxelizeRegion(glm::min(oldMin, newMin), glm::max(oldMax, newMax),
+                            lightPosition, lightColor, hasShadows);
+    voxelizedDynamicPosition = scene.dynamicMeshPosition;
+  }
+  // Material edits only relight the voxels of the material.
+  for (size_t materialId : editedMaterials) {
+    voxelmap.updateMaterial(materialId, lightPosition, lightColor,
+                            hasShadows);
   }
+  editedMaterials.clear();
+  voxelmap.advanceRebuild();
+  voxelmap.propagateLight(lightPosition, lightColor, hasShadows);
   if (engineMode == EngineMode::VISUALIZE) {
     voxelmap.visualize(camera);
   } else if (engineMode == EngineMode::RENDER) {
@@ -21,7 +21,9 @@ private:
   int voxelRes;
   bool viewMode;
   bool revoxelize;
+  bool relight;
   bool regenShadowMap;
+  std::vector<size_t> editedMaterials; // not applied to the voxels yet
   bool visualize;
   bool hasShadows;
   bool diffuseGI;
@@ -40,6 +42,7 @@ private:
   glm::vec3 &dynamicEmissiveRef;
   glm::vec3 lightPosition;
   glm::vec3 lightColor;
+  glm::vec3 voxelizedDynamicPosition; // where the voxels last saw the bunny
 
 public:
   Editor(Scene &_scene, ShadowMap &_shadowMap, VoxelMap &_voxelmap,
@@ -54,8 +57,10 @@ public:
         dynamicEmissiveRef(_scene.getDynamicEmissiveRef()) {
     lightPosition = glm::vec3(200.0f, 2000.0f, 450.0f);
     lightColor = glm::vec3(1.0f, 1.0f, 1.0f);
+    voxelizedDynamicPosition = _scene.dynamicMeshPosition;
     viewMode = true, voxelRes = 0, hasShadows = true, diffuseGI = true,
-    specularGI = true, revoxelize = true, regenShadowMap = true;
+    specularGI = true, revoxelize = true, relight = false,
+    regenShadowMap = true;
   }
 
   void processCameraInput(GLFWwindow *window);
@@ -1,23 +1,105 @@
 #include "camera.h"
 #include "constants.h"
+#include "cpuvoxelizer.h"
 #include "editor.h"
+#include "octree.h"
 #include "scene.h"
 #include "shader.h"
 #include "shadowmap.h"
 #include "utils.h"
+#include "voxelbake.h"
 #include "voxelmap.h"
 
 #include <iostream>
 
 Camera camera(glm::vec3(100, 100, 100));
+const char *VOXEL_BAKE_PATH = "assets/sponza.vxvol";
 
-int main() {
+void loadScene(Scene &scene) {
+  scene.loadObj("assets/crytek-sponza/", "assets/crytek-sponza/sponza.obj", 0);
+  scene.loadObj("assets/", "assets/bunny.obj", 1);
+}
+
+// Voxelizes the static meshes on the CPU and writes them to a voxel bake the
+// next launches load instead of voxelizing, needs no GL context.
+int bakeVoxels(const char *path, bool bricked) {
+  Scene scene = Scene(SceneStorage::CPU);
+  loadScene(scene);
+
+  glm::ivec3 dim = VoxelMap::fitGrid(scene);
+  CpuVoxelizer cpuVoxelizer(scene, dim);
+  cpuVoxelizer.voxelize();
+  std::vector<unsigned char> volumes[3];
+  for (int i = 0; i < 3; i++)
+    volumes[i] = cpuVoxelizer.getVolume(i);
+  if (!VoxelBake::write(path, scene.getStaticHash(), VOXEL_DIM, dim, volumes,
+                        bricked)) {
+    return 1;
+  }
+  printf("Baked %dx%dx%d voxels to %s in %.2f ms\n", dim.x, dim.y, dim.z,
+         path, cpuVoxelizer.getVoxelizeTime());
+  return 0;
+}
+
+// Voxelizes the static meshes on the GPU and on the CPU and prints how far the
+// geometry volumes are apart, and the mips the mip filter builds from the
+// albedo and normal volumes. The GPU voxelizes conservatively so both write
+// every voxel a triangle overlaps. Material IDs are not filtered.
+void compareVoxelizers(Scene &scene, VoxelMap &voxelMap,
+                       glm::vec3 lightPosition) {
+  const char *names[3] = {"albedo", "normal", "material"};
+  glm::ivec3 dim = voxelMap.getGridDim();
+
+  voxelMap.setConservative(true);
+  voxelMap.voxelize(lightPosition, glm::vec3(1.0f), 1);
+  CpuVoxelizer cpuVoxelizer(scene, dim);
+  cpuVoxelizer.voxelize();
+
+  printf("Grid %dx%dx%d, GPU %.2f ms, CPU %.2f ms on %d threads\n", dim.x,
+         dim.y, dim.z, voxelMap.getVoxelizeTime(),
+         cpuVoxelizer.getVoxelizeTime(), cpuVoxelizer.getThreadCount());
+  for (int i = 0; i < 3; i++) {
+    VolumeComparison result = CpuVoxelizer::compare(
+        cpuVoxelizer.getVolume(i), voxelMap.readGeometryVolume(i));
+    printf("%s: %zu voxels in both, %zu only on the CPU, %zu only on the GPU, "
+           "color error mean %.2f max %d\n",
+           names[i], result.matching, result.onlyFirst, result.onlySecond,
+           result.meanError, result.maxError);
+  }
+  for (int i = 0; i < 2; i++) {
+    std::vector<std::vector<unsigned char>> gpuMips =
+        voxelMap.readGeometryMipmaps(i);
+    std::vector<std::vector<unsigned char>> cpuMips =
+        cpuVoxelizer.buildMipmaps(i, voxelMap.getMipmapFilter(),
+                                  (int)gpuMips.size());
+    for (size_t level = 1; level < gpuMips.size(); level++) {
+      VolumeComparison result =
+          CpuVoxelizer::compare(cpuMips[level], gpuMips[level]);
+      printf("%s mip %zu: %zu texels in both, %zu only on the CPU, %zu only "
+             "on the GPU, color error mean %.2f max %d\n",
+             names[i], level, result.matching, result.onlyFirst,
+             result.onlySecond, result.meanError, result.maxError);
+    }
+  }
+}
+
+// Usage: vxgi [--compare-voxels | --bake [path] [--raw]]
+int main(int argc, char **argv) {
+  std::string mode = argc > 1 ? argv[1] : "";
+  if (mode == "--bake") {
+    std::string path = VOXEL_BAKE_PATH;
+    if (argc > 2 && argv[2][0] != '-')
+      path = argv[2];
+    bool raw = std::string(argv[argc - 1]) == "--raw";
+    return bakeVoxels(path.c_str(), !raw);
+  }
+  bool compareVoxels = mode == "--compare-voxels";
 
   GLFWwindow *window = setupWindow(SCR_WIDTH, SCR_HEIGHT);
 
-  Scene scene = Scene();
-  scene.loadObj("assets/crytek-sponza/", "assets/crytek-sponza/sponza.obj", 0);
-  scene.loadObj("assets/", "assets/bunny.obj", 1);
+  Scene scene = Scene(compareVoxels ? SceneStorage::GPU_AND_CPU
+                                    : SceneStorage::GPU);
+  loadScene(scene);
 
   glm::vec3 lightPosition(200.0f, 2000.0f, 450.0f);
 
@@ -25,10 +107,27 @@ int main() {
       ShadowMap("shaders/depthMap.vert", "shaders/depthMap.frag",
                 "shaders/debugDepthMap.vert", "shaders/debugDepthMap.frag");
 
+  VoxelOctree octree = VoxelOctree(
+      "shaders/octreeFlag.comp", "shaders/octreeAlloc.comp",
+      "shaders/octreeBrickAlloc.comp", "shaders/octreeWriteLeaf.comp",
+      "shaders/octreeMipmap.comp");
+
   VoxelMap voxelMap = VoxelMap(
       "shaders/voxelization.vert", "shaders/voxelization.frag",
-      "shaders/voxelization.geom", "shaders/vis.vert", "shaders/vis.frag",
-      "shaders/vct.vert", "shaders/vct.frag", scene, shadowMap);
+      "shaders/voxelization.geom", "shaders/voxelizationAxis.vert",
+      "shaders/voxelizeTriangles.comp", "shaders/vis.vert", "shaders/vis.frag",
+      "shaders/vct.vert", "shaders/vct.frag", "shaders/voxelMipmap.comp",
+      "shaders/lightInjection.comp", "shaders/voxelResolve.comp",
+      "shaders/anisotropicMipmap.comp", "shaders/occupancyMask.comp",
+      "shaders/distanceField.comp", "shaders/irradianceCache.comp", scene,
+      shadowMap, octree);
+
+  if (compareVoxels) {
+    compareVoxelizers(scene, voxelMap, lightPosition);
+    glfwTerminate();
+    return 0;
+  }
+  voxelMap.loadBake(VOXEL_BAKE_PATH);
 
   glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
@@ -3,6 +3,16 @@
 
 #include "utils.h"
 
+#include <vector>
+
+// CPU copy of a texture, kept for the CPU voxelizer. Level 0 is the image as
+// loaded, every further level is a box filtered half of the previous one.
+class Image {
+public:
+  int width, height, channels;
+  std::vector<std::vector<unsigned char>> levels;
+};
+
 class Material {
 public:
   glm::vec3 kd;
@@ -12,10 +22,11 @@ public:
   GLuint diffuseMap;
   GLuint specularMap;
   GLuint normalMap;
+  int diffuseImage; // CPU copy of the diffuse map, -1 if it has none
 
   Material()
       : kd(0.0f), ks(0.0f), ke(0.0f), shininess(0.0f), diffuseMap(0),
-        specularMap(0), normalMap(0) {}
+        specularMap(0), normalMap(0), diffuseImage(-1) {}
 };
 
 #endif /* ifndef MATERIAL_H */
@@ -3,10 +3,20 @@
 
 #include "utils.h"
 
+#include <vector>
+
 class Mesh {
 public:
   GLuint vao, vbo;
+  GLuint stride; // floats per vertex
   int numTriangles;
+  // The triangles are sorted by the dominant axis of their normal, x, y then
+  // z. Axis i holds the triangles [axisFirst[i], axisFirst[i + 1]), from the
+  // largest to the smallest.
+  int axisFirst[4];
+  std::vector<float> triangleSizes; // longest side of each triangle's bounds
+  std::vector<GLfloat> vertices; // CPU copy of the vertex buffer, if kept
+  glm::vec3 aabbMin, aabbMax; // object space bounds
   size_t materialId;
   int isDynamic;
 };
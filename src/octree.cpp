@@ -0,0 +1,260 @@
+#include "octree.h"
+
+#include <algorithm>
+#include <cmath>
+
+void VoxelOctree::initBuffers() {
+  glGenBuffers(1, &fragmentList);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, fragmentList);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, 0, NULL, GL_DYNAMIC_DRAW);
+  initNodePool();
+
+  GLuint zero[2] = {0, 0};
+  glGenBuffers(1, &fragmentCounter);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, fragmentCounter);
+  glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), zero,
+               GL_DYNAMIC_DRAW);
+
+  // Offset 0 counts allocated node tiles, offset 4 counts allocated bricks.
+  glGenBuffers(1, &allocCounter);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, allocCounter);
+  glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(zero), zero, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+  initBrickPool();
+}
+
+void VoxelOctree::initNodePool() {
+  glGenBuffers(1, &nodePool);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodePool);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(GLuint) * nodeCapacity,
+               NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void VoxelOctree::initBrickPool() {
+  int poolDim = 2 * brickPoolDim;
+  glGenTextures(1, &brickPool);
+  glBindTexture(GL_TEXTURE_3D, brickPool);
+  glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA8, poolDim, poolDim, poolDim);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void VoxelOctree::releaseBuffers() {
+  glDeleteBuffers(1, &fragmentList);
+  glDeleteBuffers(1, &nodePool);
+  glDeleteBuffers(1, &fragmentCounter);
+  glDeleteBuffers(1, &allocCounter);
+  glDeleteTextures(1, &brickPool);
+  fragmentCapacity = 0;
+  nodeCount = 0;
+  brickCount = 0;
+}
+
+void VoxelOctree::dispatch(Shader &shader, GLuint count) {
+  const GLuint localSize = 64, maxGroups = 65535;
+  GLuint groups = (count + localSize - 1) / localSize;
+  if (groups == 0)
+    return;
+
+  shader.setUniform(uniformType::u1, &count, "count");
+  GLuint groupsX = std::min(groups, maxGroups);
+  GLuint groupsY = (groups + groupsX - 1) / groupsX;
+  glDispatchCompute(groupsX, groupsY, 1);
+}
+
+GLuint VoxelOctree::readCounter(GLuint buffer, GLuint offset) {
+  GLuint value = 0;
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, buffer);
+  glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, offset, sizeof(GLuint), &value);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+  return value;
+}
+
+void VoxelOctree::beginFragmentList(Shader &voxelizeShader) {
+  GLuint zero = 0;
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, fragmentCounter);
+  glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &zero);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+
+  glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, fragmentCounter);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, fragmentList);
+
+  voxelizeShader.setUniform(uniformType::i1, (void *)&DIM, "fragmentListDim");
+  voxelizeShader.setUniform(uniformType::u1, &fragmentCapacity,
+                            "fragmentCapacity");
+}
+
+bool VoxelOctree::endFragmentList() {
+  fragmentCount = readCounter(fragmentCounter, 0);
+  if (fragmentCount <= fragmentCapacity) {
+    return false;
+  }
+
+  // The list was too small to hold every fragment, grow it so the caller can
+  // rasterize the scene again. It is kept between builds, with some room
+  // for the dynamic meshes to move into.
+  fragmentCapacity = fragmentCount + fragmentCount / 4;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, fragmentList);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(GLuint) * fragmentCapacity,
+               NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  return true;
+}
+
+// Builds the octree from the fragment list, growing the pools and building
+// again while the octree overflows them. Returns false if it does not fit in
+// the largest pools the GL allows.
+bool VoxelOctree::build() {
+  while (!buildPools()) {
+    GLuint nodesNeeded = nodeCount, bricksNeeded = brickCount;
+    if (!growPools(nodesNeeded, bricksNeeded)) {
+      std::cout << "Octree pool full: " << nodesNeeded << " nodes, "
+                << bricksNeeded << " bricks" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// One build over the current pools. When they overflow, it stops and leaves
+// the nodes and bricks asked for so far in nodeCount and brickCount, a lower
+// bound of what the octree needs as the children of the nodes that did not
+// fit were never flagged.
+bool VoxelOctree::buildPools() {
+  GLuint zero[2] = {0, 0};
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, allocCounter);
+  glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), zero);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodePool);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+                    GL_UNSIGNED_INT, NULL);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  GLuint clearColor = 0;
+  glClearTexImage(brickPool, 0, GL_RGBA, GL_UNSIGNED_BYTE, &clearColor);
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, fragmentList);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, nodePool);
+  glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, allocCounter);
+  glBindImageTexture(0, brickPool, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA8);
+
+  // Nodes of level l live in [levelStart[l], levelStart[l + 1]).
+  levelStart.assign(LEVELS + 1, 0);
+  levelStart[1] = 1;
+
+  // Flag the nodes touched by fragments and subdivide them, top-down.
+  for (int level = 0; level < LEVELS; level++) {
+    flagShader.use();
+    flagShader.setUniform(uniformType::i1, &level, "level");
+    flagShader.setUniform(uniformType::i1, (void *)&LEVELS, "levels");
+    dispatch(flagShader, fragmentCount);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    if (level == LEVELS - 1)
+      break;
+
+    allocShader.use();
+    allocShader.setUniform(uniformType::u1, &levelStart[level], "levelStart");
+    allocShader.setUniform(uniformType::u1, &nodeCapacity, "nodeCapacity");
+    dispatch(allocShader, levelStart[level + 1] - levelStart[level]);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                    GL_ATOMIC_COUNTER_BARRIER_BIT);
+
+    GLuint tiles = readCounter(allocCounter, 0);
+    if (1 + 8 * tiles > nodeCapacity) {
+      nodeCount = 1 + 8 * tiles;
+      brickCount = 0;
+      return false;
+    }
+    levelStart[level + 2] = 1 + 8 * tiles;
+  }
+  nodeCount = levelStart[LEVELS];
+
+  // Every flagged node gets a brick.
+  GLuint brickCapacity = brickPoolDim * brickPoolDim * brickPoolDim;
+  brickAllocShader.use();
+  brickAllocShader.setUniform(uniformType::u1, &brickCapacity,
+                              "brickCapacity");
+  dispatch(brickAllocShader, nodeCount);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                  GL_ATOMIC_COUNTER_BARRIER_BIT);
+  brickCount = readCounter(allocCounter, sizeof(GLuint));
+  if (brickCount > brickCapacity)
+    return false;
+
+  // Write the fragments into the leaf bricks.
+  writeLeafShader.use();
+  writeLeafShader.setUniform(uniformType::i1, (void *)&LEVELS, "levels");
+  writeLeafShader.setUniform(uniformType::i1, &brickPoolDim, "brickPoolDim");
+  dispatch(writeLeafShader, fragmentCount);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+  // Average the children into the interior bricks, bottom-up.
+  mipmapShader.use();
+  mipmapShader.setUniform(uniformType::i1, &brickPoolDim, "brickPoolDim");
+  for (int level = LEVELS - 2; level >= 0; level--) {
+    mipmapShader.setUniform(uniformType::u1, &levelStart[level],
+                            "levelStart");
+    dispatch(mipmapShader, levelStart[level + 1] - levelStart[level]);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_TEXTURE_FETCH_BARRIER_BIT);
+  }
+  return true;
+}
+
+// Grows the pools that were too small for a build, with a quarter more room
+// than it asked for and at least doubling them, since what it asked for is
+// only a lower bound. Fails once a pool is at its GL limit: node indices
+// have to fit the shader storage block and leave the flag bit free, and the
+// brick pool the largest 3D texture.
+bool VoxelOctree::growPools(GLuint nodesNeeded, GLuint bricksNeeded) {
+  GLint64 maxBlockSize;
+  GLint max3DTextureSize;
+  glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockSize);
+  glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max3DTextureSize);
+  GLuint maxNodes = (GLuint)std::min<GLint64>(
+      maxBlockSize / (2 * sizeof(GLuint)), 0x7fffffff);
+  int maxBrickPoolDim = max3DTextureSize / 2;
+
+  if (nodesNeeded > nodeCapacity) {
+    if (nodeCapacity >= maxNodes)
+      return false;
+    GLuint64 capacity = std::max<GLuint64>(
+        2 * (GLuint64)nodeCapacity, nodesNeeded + (GLuint64)nodesNeeded / 4);
+    nodeCapacity = (GLuint)std::min<GLuint64>(capacity, maxNodes);
+    glDeleteBuffers(1, &nodePool);
+    initNodePool();
+  }
+
+  GLuint brickCapacity = brickPoolDim * brickPoolDim * brickPoolDim;
+  if (bricksNeeded > brickCapacity) {
+    if (brickPoolDim >= maxBrickPoolDim)
+      return false;
+    double bricks = std::max(2.0 * brickCapacity, 1.25 * bricksNeeded);
+    brickPoolDim =
+        std::min((int)std::ceil(std::cbrt(bricks)), maxBrickPoolDim);
+    glDeleteTextures(1, &brickPool);
+    initBrickPool();
+  }
+  return true;
+}
+
+void VoxelOctree::bind(Shader &shader, GLuint brickPoolUnit) {
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, nodePool);
+  shader.setUniform(uniformType::i1, (void *)&LEVELS, "octreeLevels");
+  shader.setUniform(uniformType::i1, &brickPoolDim, "brickPoolDim");
+  shader.setUniform(uniformType::i1, &brickPoolUnit, "brickPool");
+  glActiveTexture(GL_TEXTURE0 + brickPoolUnit);
+  glBindTexture(GL_TEXTURE_3D, brickPool);
+}
+
+size_t VoxelOctree::getMemoryUsage() {
+  size_t poolDim = 2 * brickPoolDim;
+  return 2 * sizeof(GLuint) * ((size_t)nodeCapacity + fragmentCapacity) +
+         4 * poolDim * poolDim * poolDim;
+}
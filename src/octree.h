@@ -0,0 +1,68 @@
+#ifndef VOXEL_OCTREE_H
+#define VOXEL_OCTREE_H
+
+#include "shader.h"
+#include "utils.h"
+
+#include <vector>
+
+// Sparse voxel octree with a brick pool. Every occupied node owns a 2x2x2
+// brick in a 3D texture; leaf bricks hold the voxelized radiance and interior
+// bricks hold the averaged radiance of their children (the octree equivalent
+// of a mip level). The pools start at a size that fits the sponza and grow
+// when a build overflows them, up to what the GL limits allow.
+class VoxelOctree {
+private:
+  const int DIM = 1024;  // effective leaf resolution
+  const int LEVELS = 10; // log2(DIM), node levels 0 .. LEVELS - 1
+  int brickPoolDim;      // bricks per axis in the brick pool
+  GLuint nodeCapacity;
+  GLuint fragmentList;
+  GLuint fragmentCounter;
+  GLuint fragmentCapacity;
+  GLuint fragmentCount;
+  GLuint nodePool;
+  GLuint allocCounter;
+  GLuint brickPool;
+  GLuint nodeCount;
+  GLuint brickCount;
+  std::vector<GLuint> levelStart;
+  Shader flagShader;
+  Shader allocShader;
+  Shader brickAllocShader;
+  Shader writeLeafShader;
+  Shader mipmapShader;
+
+  void dispatch(Shader &shader, GLuint count);
+  GLuint readCounter(GLuint buffer, GLuint offset);
+  void initNodePool();
+  void initBrickPool();
+  bool buildPools();
+  bool growPools(GLuint nodesNeeded, GLuint bricksNeeded);
+
+public:
+  VoxelOctree(const char *flagCsPath, const char *allocCsPath,
+              const char *brickAllocCsPath, const char *writeLeafCsPath,
+              const char *mipmapCsPath)
+      : brickPoolDim(120), nodeCapacity(1 + 8 * (3 << 17)),
+        fragmentCapacity(0), fragmentCount(0), nodeCount(0), brickCount(0),
+        flagShader(flagCsPath), allocShader(allocCsPath),
+        brickAllocShader(brickAllocCsPath), writeLeafShader(writeLeafCsPath),
+        mipmapShader(mipmapCsPath) {}
+
+  void initBuffers();
+  void releaseBuffers();
+  void beginFragmentList(Shader &voxelizeShader);
+  bool endFragmentList();
+  bool build();
+  void bind(Shader &shader, GLuint brickPoolUnit);
+
+  int getDim() { return DIM; }
+  size_t getMemoryUsage();
+  float getNodeUsage() { return (float)nodeCount / nodeCapacity; }
+  float getBrickUsage() {
+    return (float)brickCount / (brickPoolDim * brickPoolDim * brickPoolDim);
+  }
+};
+
+#endif /* ifndef VOXEL_OCTREE_H */
@@ -1,6 +1,7 @@
 #include "scene.h"
 #include "stb_image.h"
 
+#include <algorithm>
 #include <iostream>
 
 void Scene::loadTextureFromFile(const char *texturePath,
@@ -18,6 +19,28 @@ void Scene::loadTextureFromFile(const char *texturePath,
   std::cout << "Loaded texture: " << textureName << ", w = " << w
             << ", h = " << h << ", comp = " << comp << std::endl;
 
+  if (comp != 1 && comp != 3 && comp != 4) {
+    std::cout << "Comp invalid: " << comp << std::endl;
+    exit(1);
+  }
+
+  if (storage != SceneStorage::GPU) {
+    Image cpuImage;
+    cpuImage.width = w;
+    cpuImage.height = h;
+    cpuImage.channels = comp;
+    cpuImage.levels.push_back(
+        std::vector<unsigned char>(image, image + (size_t)w * h * comp));
+    buildImageMips(cpuImage);
+    imageIds.insert(std::make_pair(textureName, (int)images.size()));
+    images.push_back(cpuImage);
+  }
+
+  if (storage == SceneStorage::CPU) {
+    stbi_image_free(image);
+    return;
+  }
+
   glGenTextures(1, &textureId);
   glBindTexture(GL_TEXTURE_2D, textureId);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
@@ -29,12 +52,9 @@ void Scene::loadTextureFromFile(const char *texturePath,
   } else if (comp == 3) {
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE,
                  image);
-  } else if (comp == 4) {
+  } else {
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE,
                  image);
-  } else {
-    std::cout << "Comp invalid: " << comp << std::endl;
-    exit(1);
   }
   glGenerateMipmap(GL_TEXTURE_2D);
   glBindTexture(GL_TEXTURE_2D, 0);
@@ -42,6 +62,48 @@ void Scene::loadTextureFromFile(const char *texturePath,
   textures.insert(std::make_pair(textureName, textureId));
 }
 
+// Box filters the mip chain of a CPU image down to 1x1, like
+// glGenerateMipmap.
+void Scene::buildImageMips(Image &image) {
+  int w = image.width, h = image.height, comp = image.channels;
+  while (w > 1 || h > 1) {
+    const std::vector<unsigned char> &source = image.levels.back();
+    int mipW = std::max(w / 2, 1), mipH = std::max(h / 2, 1);
+    std::vector<unsigned char> mip((size_t)mipW * mipH * comp);
+    for (int y = 0; y < mipH; y++) {
+      for (int x = 0; x < mipW; x++) {
+        int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+        int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+        for (int c = 0; c < comp; c++) {
+          int sum = source[((size_t)y0 * w + x0) * comp + c] +
+                    source[((size_t)y0 * w + x1) * comp + c] +
+                    source[((size_t)y1 * w + x0) * comp + c] +
+                    source[((size_t)y1 * w + x1) * comp + c];
+          mip[((size_t)y * mipW + x) * comp + c] = (sum + 2) / 4;
+        }
+      }
+    }
+    image.levels.push_back(mip);
+    w = mipW;
+    h = mipH;
+  }
+}
+
+// Loads a texture of a material once and returns its GL texture, and the
+// index of its CPU copy if image is given.
+void Scene::loadMap(const char *textureDir, const std::string &textureName,
+                    GLuint &map, int *image) {
+  if (textures.find(textureName) == textures.end() &&
+      imageIds.find(textureName) == imageIds.end()) {
+    std::string texturePath = textureDir + textureName;
+    loadTextureFromFile(texturePath.c_str(), textureName.c_str());
+  }
+  if (textures.find(textureName) != textures.end())
+    map = textures[textureName];
+  if (image && imageIds.find(textureName) != imageIds.end())
+    *image = imageIds[textureName];
+}
+
 void Scene::loadObj(const char *textureDir, const char *filePath,
                     int isDynamic) {
   tinyobj::attrib_t attrib;
@@ -70,34 +132,26 @@ void Scene::loadObj(const char *textureDir, const char *filePath,
     Material material;
     tinyobj::material_t *mp = &tmaterials[m];
 
+    // The CPU voxelizer only needs the diffuse maps.
     if (mp->diffuse_texname.length() > 0) {
-      std::string textureName = mp->diffuse_texname;
-      if (textures.find(textureName) == textures.end()) {
-        std::string texturePath = textureDir + textureName;
-        loadTextureFromFile(texturePath.c_str(), textureName.c_str());
-      }
-      material.diffuseMap = textures[textureName];
+      loadMap(textureDir, mp->diffuse_texname, material.diffuseMap,
+              &material.diffuseImage);
     }
 
-    if (mp->specular_texname.length() > 0) {
-      std::string textureName = mp->specular_texname;
-      if (textures.find(textureName) == textures.end()) {
-        std::string texturePath = textureDir + textureName;
-        loadTextureFromFile(texturePath.c_str(), textureName.c_str());
-      }
-      material.specularMap = textures[textureName];
+    if (storage != SceneStorage::CPU && mp->specular_texname.length() > 0) {
+      loadMap(textureDir, mp->specular_texname, material.specularMap, NULL);
     }
 
-    if (mp->bump_texname.length() > 0) {
-      std::string textureName = mp->bump_texname;
-      if (textures.find(textureName) == textures.end()) {
-        std::string texturePath = textureDir + textureName;
-        loadTextureFromFile(texturePath.c_str(), textureName.c_str());
-      }
-      material.normalMap = textures[textureName];
+    if (storage != SceneStorage::CPU && mp->bump_texname.length() > 0) {
+      loadMap(textureDir, mp->bump_texname, material.normalMap, NULL);
     }
 
     material.kd = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
+    if (!isDynamic) {
+      staticHash = hashBytes(mp->diffuse_texname.c_str(),
+                             mp->diffuse_texname.size(), staticHash);
+      staticHash = hashBytes(mp->diffuse, sizeof(mp->diffuse), staticHash);
+    }
     material.ks = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
     material.shininess = mp->shininess;
 
@@ -113,10 +167,19 @@ void Scene::loadObj(const char *textureDir, const char *filePath,
 
   for (size_t s = 0; s < shapes.size(); s++) {
     Mesh mesh;
+    mesh.aabbMin = glm::vec3(FLT_MAX);
+    mesh.aabbMax = glm::vec3(-FLT_MAX);
     std::vector<GLfloat> buffer;
+    std::vector<GLfloat> axisBuffers[3];
+    std::vector<float> axisSizes[3];
     Material material = materials[shapes[s].mesh.material_ids[0]];
     float scaleFactor = 1.0;
 
+    if (!isDynamic) {
+      staticHash = hashBytes(&shapes[s].mesh.material_ids[0], sizeof(int),
+                             staticHash);
+    }
+
     if (isDynamic) {
       Material material = Material();
       material.kd = glm::vec3(0.67, 0.84, 0.90);
@@ -168,6 +231,37 @@ void Scene::loadObj(const char *textureDir, const char *filePath,
         tc[2][1] = 0.0f;
       }
 
+      // Only what the voxelizer reads goes into the hash, the tangents are
+      // not stored without a GL context.
+      if (!isDynamic) {
+        staticHash = hashBytes(v, sizeof(v), staticHash);
+        staticHash = hashBytes(n, sizeof(n), staticHash);
+        staticHash = hashBytes(tc, sizeof(tc), staticHash);
+      }
+
+      // bin the triangle by the axis it is voxelized along
+      glm::vec3 edge1 = glm::vec3(v[1][0] - v[0][0], v[1][1] - v[0][1],
+                                  v[1][2] - v[0][2]);
+      glm::vec3 edge2 = glm::vec3(v[2][0] - v[0][0], v[2][1] - v[0][1],
+                                  v[2][2] - v[0][2]);
+      glm::vec3 faceNormal = glm::abs(glm::cross(edge1, edge2));
+      float dominant =
+          std::max(faceNormal.x, std::max(faceNormal.y, faceNormal.z));
+      int axis = 2;
+      if (dominant == faceNormal.x) {
+        axis = 0;
+      } else if (dominant == faceNormal.y) {
+        axis = 1;
+      }
+      std::vector<GLfloat> &axisBuffer = axisBuffers[axis];
+      glm::vec3 p0 = glm::vec3(v[0][0], v[0][1], v[0][2]);
+      glm::vec3 p1 = glm::vec3(v[1][0], v[1][1], v[1][2]);
+      glm::vec3 p2 = glm::vec3(v[2][0], v[2][1], v[2][2]);
+      glm::vec3 extent = glm::max(p0, glm::max(p1, p2)) -
+                         glm::min(p0, glm::min(p1, p2));
+      axisSizes[axis].push_back(
+          scaleFactor * std::max(extent.x, std::max(extent.y, extent.z)));
+
       glm::vec3 tangent;
       glm::vec3 bitangent;
       if (material.normalMap > 0) {
@@ -178,24 +272,29 @@ void Scene::loadObj(const char *textureDir, const char *filePath,
       }
 
       for (int k = 0; k < 3; k++) {
-        buffer.push_back(v[k][0] * scaleFactor);
-        buffer.push_back(v[k][1] * scaleFactor);
-        buffer.push_back(v[k][2] * scaleFactor);
-        buffer.push_back(n[k][0]);
-        buffer.push_back(n[k][1]);
-        buffer.push_back(n[k][2]);
-        buffer.push_back(tc[k][0]);
-        buffer.push_back(tc[k][1]);
+        axisBuffer.push_back(v[k][0] * scaleFactor);
+        axisBuffer.push_back(v[k][1] * scaleFactor);
+        axisBuffer.push_back(v[k][2] * scaleFactor);
+        axisBuffer.push_back(n[k][0]);
+        axisBuffer.push_back(n[k][1]);
+        axisBuffer.push_back(n[k][2]);
+        axisBuffer.push_back(tc[k][0]);
+        axisBuffer.push_back(tc[k][1]);
 
         if (material.normalMap > 0) {
-          buffer.push_back(tangent.x);
-          buffer.push_back(tangent.y);
-          buffer.push_back(tangent.z);
-          buffer.push_back(bitangent.x);
-          buffer.push_back(bitangent.y);
-          buffer.push_back(bitangent.z);
+          axisBuffer.push_back(tangent.x);
+          axisBuffer.push_back(tangent.y);
+          axisBuffer.push_back(tangent.z);
+          axisBuffer.push_back(bitangent.x);
+          axisBuffer.push_back(bitangent.y);
+          axisBuffer.push_back(bitangent.z);
         }
 
+        glm::vec3 position =
+            scaleFactor * glm::vec3(v[k][0], v[k][1], v[k][2]);
+        mesh.aabbMin = glm::min(mesh.aabbMin, position);
+        mesh.aabbMax = glm::max(mesh.aabbMax, position);
+
         gMinX = std::min(gMinX, v[k][0]);
         gMinY = std::min(gMinY, v[k][1]);
         gMinZ = std::min(gMinZ, v[k][2]);
@@ -206,18 +305,46 @@ void Scene::loadObj(const char *textureDir, const char *filePath,
       }
     }
 
+    GLuint stride = 8;
+    if (material.normalMap > 0) {
+      stride += 6;
+    }
+
+    // Sorting by size lets the voxelizer split off the triangles smaller
+    // than a voxel with a binary search.
+    mesh.axisFirst[0] = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      std::vector<float> &sizes = axisSizes[axis];
+      std::vector<int> order(sizes.size());
+      for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+      std::stable_sort(order.begin(), order.end(),
+                       [&](int a, int b) { return sizes[a] > sizes[b]; });
+      for (int i : order) {
+        std::vector<GLfloat>::iterator triangle =
+            axisBuffers[axis].begin() + i * 3 * stride;
+        buffer.insert(buffer.end(), triangle, triangle + 3 * stride);
+        mesh.triangleSizes.push_back(sizes[i]);
+      }
+      mesh.axisFirst[axis + 1] = buffer.size() / stride / 3;
+    }
+
     mesh.vao = 0;
     mesh.vbo = 0;
+    mesh.stride = stride;
     mesh.materialId = shapes[s].mesh.material_ids[0];
     mesh.isDynamic = isDynamic;
     if (mesh.isDynamic) {
       mesh.materialId = materials.size() - 1;
       dynamicIdx = mesh.materialId;
     }
+    mesh.numTriangles = buffer.size() / (stride) / 3;
 
-    GLuint stride = 8;
-    if (material.normalMap > 0) {
-      stride += 6;
+    if (storage != SceneStorage::GPU)
+      mesh.vertices = buffer;
+    if (storage == SceneStorage::CPU) {
+      meshes.push_back(mesh);
+      continue;
     }
 
     glGenVertexArrays(1, &mesh.vao);
@@ -252,74 +379,230 @@ void Scene::loadObj(const char *textureDir, const char *filePath,
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
 
-    mesh.numTriangles = buffer.size() / (stride) / 3;
-
     meshes.push_back(mesh);
   }
 }
 
-void Scene::draw(Shader &shader, int textureUnit) {
-  shader.use();
+void Scene::getMeshBounds(const Mesh &mesh, glm::vec3 &boundsMin,
+                          glm::vec3 &boundsMax) {
+  boundsMin = mesh.aabbMin;
+  boundsMax = mesh.aabbMax;
+  if (mesh.isDynamic) {
+    boundsMin += dynamicMeshPosition;
+    boundsMax += dynamicMeshPosition;
+  }
+}
 
+// World space bounds of the dynamic meshes if they were moved to position.
+void Scene::getDynamicBounds(glm::vec3 position, glm::vec3 &boundsMin,
+                             glm::vec3 &boundsMax) {
+  boundsMin = glm::vec3(FLT_MAX);
+  boundsMax = glm::vec3(-FLT_MAX);
   for (size_t i = 0; i < meshes.size(); i++) {
-    Mesh mesh = meshes[i];
-    Material material = materials[mesh.materialId];
-    glBindVertexArray(mesh.vao);
+    if (!meshes[i].isDynamic)
+      continue;
+    boundsMin = glm::min(boundsMin, meshes[i].aabbMin + position);
+    boundsMax = glm::max(boundsMax, meshes[i].aabbMax + position);
+  }
+}
 
-    int zero = 0, one = 1, mapUnit = textureUnit;
-    shader.setUniform(uniformType::fv3, glm::value_ptr(material.kd), "kd");
-    shader.setUniform(uniformType::fv3, glm::value_ptr(material.ks), "ks");
-    shader.setUniform(uniformType::fv3, glm::value_ptr(material.ke), "ke");
-    shader.setUniform(uniformType::f1, &(material.shininess), "shininess");
-    shader.setUniform(uniformType::i1, &zero, "hasDiffuseMap");
-    shader.setUniform(uniformType::i1, &zero, "hasSpecularMap");
-    shader.setUniform(uniformType::i1, &zero, "hasNormalMap");
-
-    if (material.diffuseMap > 0) {
-      shader.setUniform(uniformType::i1, &one, "hasDiffuseMap");
-    }
-    glActiveTexture(GL_TEXTURE0 + textureUnit + 0);
-    glBindTexture(GL_TEXTURE_2D, material.diffuseMap);
-    mapUnit = textureUnit + 0;
-    shader.setUniform(uniformType::i1, &mapUnit, "diffuseMap");
+// World space bounds of the dynamic meshes at position and of the shadow they
+// cast along lightDirection, clipped to the scene. The corners of the mesh
+// bounds are swept along the direction past the far end of the scene.
+void Scene::getDynamicShadowBounds(glm::vec3 position, glm::vec3 lightDirection,
+                                   glm::vec3 &boundsMin,
+                                   glm::vec3 &boundsMax) {
+  getDynamicBounds(position, boundsMin, boundsMax);
+  glm::vec3 sceneMin(gMinX, gMinY, gMinZ), sceneMax(gMaxX, gMaxY, gMaxZ);
+  glm::vec3 sweep =
+      glm::normalize(lightDirection) * glm::length(sceneMax - sceneMin);
+  boundsMin = glm::min(boundsMin, boundsMin + sweep);
+  boundsMax = glm::max(boundsMax, boundsMax + sweep);
+  boundsMin = glm::max(boundsMin, sceneMin);
+  boundsMax = glm::min(boundsMax, sceneMax);
+}
 
-    if (material.specularMap > 0) {
-      shader.setUniform(uniformType::i1, &one, "hasSpecularMap");
+// World space bounds of the meshes of a set that use a material. Returns false
+// if none do.
+bool Scene::getMaterialBounds(size_t materialId, MeshSet meshSet,
+                              glm::vec3 &boundsMin, glm::vec3 &boundsMax) {
+  boundsMin = glm::vec3(FLT_MAX);
+  boundsMax = glm::vec3(-FLT_MAX);
+  bool found = false;
+  for (size_t i = 0; i < meshes.size(); i++) {
+    if (meshes[i].materialId != materialId ||
+        !selectMesh(meshes[i], glm::vec3(-FLT_MAX), glm::vec3(FLT_MAX),
+                    meshSet)) {
+      continue;
     }
-    glActiveTexture(GL_TEXTURE0 + textureUnit + 1);
-    glBindTexture(GL_TEXTURE_2D, material.specularMap);
-    mapUnit = textureUnit + 1;
-    shader.setUniform(uniformType::i1, &mapUnit, "specularMap");
+    glm::vec3 meshMin, meshMax;
+    getMeshBounds(meshes[i], meshMin, meshMax);
+    boundsMin = glm::min(boundsMin, meshMin);
+    boundsMax = glm::max(boundsMax, meshMax);
+    found = true;
+  }
+  return found;
+}
 
-    if (material.normalMap > 0) {
-      shader.setUniform(uniformType::i1, &one, "hasNormalMap");
-    }
-    glActiveTexture(GL_TEXTURE0 + textureUnit + 2);
-    glBindTexture(GL_TEXTURE_2D, material.normalMap);
-    mapUnit = textureUnit + 2;
-    shader.setUniform(uniformType::i1, &mapUnit, "normalMap");
+void Scene::draw(Shader &shader, int textureUnit) {
+  draw(shader, textureUnit, glm::vec3(-FLT_MAX), glm::vec3(FLT_MAX));
+}
 
-    if (mesh.isDynamic) {
-      // Adjust its model matrix
-      glm::mat4 modelT = glm::mat4(1.0f);
-      // get dragon position
-      modelT = glm::translate(modelT, glm::vec3(dynamicMeshPosition));
-      shader.setUniform(uniformType::mat4x4, glm::value_ptr(modelT), "M");
-    }
+// Whether the mesh is in the given set and its world space bounds overlap the
+// given box.
+bool Scene::selectMesh(const Mesh &mesh, glm::vec3 boundsMin,
+                       glm::vec3 boundsMax, MeshSet meshSet) {
+  if ((meshSet == MeshSet::STATIC && mesh.isDynamic) ||
+      (meshSet == MeshSet::DYNAMIC && !mesh.isDynamic)) {
+    return false;
+  }
+  glm::vec3 meshMin, meshMax;
+  getMeshBounds(mesh, meshMin, meshMax);
+  return meshMax.x >= boundsMin.x && meshMin.x <= boundsMax.x &&
+         meshMax.y >= boundsMin.y && meshMin.y <= boundsMax.y &&
+         meshMax.z >= boundsMin.z && meshMin.z <= boundsMax.z;
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, 3 * mesh.numTriangles);
+// First triangle of the run of the given axis that is smaller than minSize.
+int Scene::getSmallTriangleFirst(const Mesh &mesh, int axis, float minSize) {
+  std::vector<float>::const_iterator first =
+      mesh.triangleSizes.begin() + mesh.axisFirst[axis];
+  std::vector<float>::const_iterator last =
+      mesh.triangleSizes.begin() + mesh.axisFirst[axis + 1];
+  return std::partition_point(first, last,
+                              [&](float size) { return size >= minSize; }) -
+         mesh.triangleSizes.begin();
+}
 
-    glActiveTexture(GL_TEXTURE0 + textureUnit + 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glActiveTexture(GL_TEXTURE0 + textureUnit + 1);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glActiveTexture(GL_TEXTURE0 + textureUnit + 2);
-    glBindTexture(GL_TEXTURE_2D, 0);
+void Scene::bindMaterial(Shader &shader, const Mesh &mesh, int textureUnit) {
+  Material material = materials[mesh.materialId];
+
+  int zero = 0, one = 1, mapUnit = textureUnit;
+  shader.setUniform(uniformType::fv3, glm::value_ptr(material.kd), "kd");
+  shader.setUniform(uniformType::fv3, glm::value_ptr(material.ks), "ks");
+  shader.setUniform(uniformType::fv3, glm::value_ptr(material.ke), "ke");
+  shader.setUniform(uniformType::f1, &(material.shininess), "shininess");
+  shader.setUniform(uniformType::i1, &zero, "hasDiffuseMap");
+  shader.setUniform(uniformType::i1, &zero, "hasSpecularMap");
+  shader.setUniform(uniformType::i1, &zero, "hasNormalMap");
+  // The geometry volumes of the voxelization keep the material of a voxel.
+  if (shader.hasUniform("materialId")) {
+    int materialId = mesh.materialId;
+    shader.setUniform(uniformType::i1, &materialId, "materialId");
+  }
 
+  if (material.diffuseMap > 0) {
+    shader.setUniform(uniformType::i1, &one, "hasDiffuseMap");
+  }
+  glActiveTexture(GL_TEXTURE0 + textureUnit + 0);
+  glBindTexture(GL_TEXTURE_2D, material.diffuseMap);
+  mapUnit = textureUnit + 0;
+  shader.setUniform(uniformType::i1, &mapUnit, "diffuseMap");
+
+  if (material.specularMap > 0) {
+    shader.setUniform(uniformType::i1, &one, "hasSpecularMap");
+  }
+  glActiveTexture(GL_TEXTURE0 + textureUnit + 1);
+  glBindTexture(GL_TEXTURE_2D, material.specularMap);
+  mapUnit = textureUnit + 1;
+  shader.setUniform(uniformType::i1, &mapUnit, "specularMap");
+
+  if (material.normalMap > 0) {
+    shader.setUniform(uniformType::i1, &one, "hasNormalMap");
+  }
+  glActiveTexture(GL_TEXTURE0 + textureUnit + 2);
+  glBindTexture(GL_TEXTURE_2D, material.normalMap);
+  mapUnit = textureUnit + 2;
+  shader.setUniform(uniformType::i1, &mapUnit, "normalMap");
+
+  // Static meshes are already in world space, reset the model matrix so a
+  // dynamic mesh drawn earlier does not move them.
+  glm::mat4 modelT = glm::mat4(1.0f);
+  if (mesh.isDynamic) {
+    // get dragon position
+    modelT = glm::translate(modelT, glm::vec3(dynamicMeshPosition));
+  }
+  shader.setUniform(uniformType::mat4x4, glm::value_ptr(modelT), "M");
+}
+
+void Scene::unbindMaterial(int textureUnit) {
+  glActiveTexture(GL_TEXTURE0 + textureUnit + 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0 + textureUnit + 1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0 + textureUnit + 2);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Only draws the meshes of the given set whose world space bounds overlap the
+// given box. When axisBinned is set, the triangles of each dominant axis are
+// drawn separately with that axis in the "dominantAxis" uniform. Triangles
+// smaller than minTriangleSize are skipped, see dispatchTriangles.
+void Scene::draw(Shader &shader, int textureUnit, glm::vec3 boundsMin,
+                 glm::vec3 boundsMax, MeshSet meshSet, bool axisBinned,
+                 float minTriangleSize) {
+  shader.use();
+
+  for (size_t i = 0; i < meshes.size(); i++) {
+    const Mesh &mesh = meshes[i];
+    if (!selectMesh(mesh, boundsMin, boundsMax, meshSet))
+      continue;
+
+    glBindVertexArray(mesh.vao);
+    bindMaterial(shader, mesh, textureUnit);
+
+    if (axisBinned || minTriangleSize > 0.0f) {
+      for (int axis = 0; axis < 3; axis++) {
+        int first = mesh.axisFirst[axis];
+        int count = getSmallTriangleFirst(mesh, axis, minTriangleSize) - first;
+        if (count == 0)
+          continue;
+        if (axisBinned)
+          shader.setUniform(uniformType::i1, &axis, "dominantAxis");
+        glDrawArrays(GL_TRIANGLES, 3 * first, 3 * count);
+      }
+    } else {
+      glDrawArrays(GL_TRIANGLES, 0, 3 * mesh.numTriangles);
+    }
+
+    unbindMaterial(textureUnit);
     glBindVertexArray(0);
   }
 }
 
+// Runs a compute shader over the triangles smaller than maxTriangleSize of the
+// selected meshes, one invocation per triangle. The vertices are bound as a
+// float array to shader storage binding 3.
+void Scene::dispatchTriangles(Shader &shader, int textureUnit,
+                              glm::vec3 boundsMin, glm::vec3 boundsMax,
+                              MeshSet meshSet, float maxTriangleSize) {
+  shader.use();
+
+  for (size_t i = 0; i < meshes.size(); i++) {
+    const Mesh &mesh = meshes[i];
+    if (!selectMesh(mesh, boundsMin, boundsMax, meshSet))
+      continue;
+
+    bindMaterial(shader, mesh, textureUnit);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, mesh.vbo);
+    int stride = mesh.stride;
+    shader.setUniform(uniformType::i1, &stride, "vertexStride");
+
+    for (int axis = 0; axis < 3; axis++) {
+      int first = getSmallTriangleFirst(mesh, axis, maxTriangleSize);
+      int count = mesh.axisFirst[axis + 1] - first;
+      if (count == 0)
+        continue;
+      shader.setUniform(uniformType::i1, &first, "firstTriangle");
+      shader.setUniform(uniformType::i1, &count, "triangleCount");
+      glDispatchCompute((count + 63) / 64, 1, 1);
+    }
+
+    unbindMaterial(textureUnit);
+  }
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, 0);
+}
+
 glm::vec3 Scene::getWorldCenter() {
   glm::vec3 gMin = glm::vec3(gMinX, gMinY, gMinZ);
   glm::vec3 gMax = glm::vec3(gMaxX, gMaxY, gMaxZ);
@@ -337,6 +620,13 @@ float Scene::getWorldSize() {
   return size;
 }
 
+glm::vec3 Scene::getWorldExtent() {
+  glm::vec3 gMin = glm::vec3(gMinX, gMinY, gMinZ);
+  glm::vec3 gMax = glm::vec3(gMaxX, gMaxY, gMaxZ);
+
+  return gMax - gMin;
+}
+
 std::vector<glm::vec3> Scene::getAABB() {
   using v = glm::vec3;
   return {
@@ -10,34 +10,74 @@
 #include <map>
 #include <vector>
 
+// Which meshes Scene::draw should draw.
+enum class MeshSet { ALL, STATIC, DYNAMIC };
+// Where Scene::loadObj keeps the meshes and textures: on the GPU only, also in
+// a CPU copy for the CPU voxelizer, or only on the CPU when there is no GL
+// context.
+enum class SceneStorage { GPU, GPU_AND_CPU, CPU };
+
 class Scene {
 private:
   std::vector<Mesh> meshes;
   std::map<std::string, GLuint> textures;
+  std::map<std::string, int> imageIds;
+  std::vector<Image> images;
   std::vector<Material> materials;
   float gMinX, gMinY, gMinZ, gMaxX, gMaxY, gMaxZ;
   int floorIdx, curtainIdx, dynamicIdx;
+  SceneStorage storage;
+  uint64_t staticHash; // of the static meshes and their materials
 
   void loadTextureFromFile(const char *texturePath, const char *textureName);
+  void loadMap(const char *textureDir, const std::string &textureName,
+               GLuint &map, int *image);
+  void buildImageMips(Image &image);
   void computeTangentAndBitangent(GLfloat pos1x, GLfloat pos1y, GLfloat pos1z,
                                   GLfloat pos2x, GLfloat pos2y, GLfloat pos2z,
                                   GLfloat pos3x, GLfloat pos3y, GLfloat pos3z,
                                   GLfloat uv1x, GLfloat uv1y, GLfloat uv2x,
                                   GLfloat uv2y, GLfloat uv3x, GLfloat uv3y,
                                   glm::vec3 &tangent, glm::vec3 &bitangent);
+  bool selectMesh(const Mesh &mesh, glm::vec3 boundsMin, glm::vec3 boundsMax,
+                  MeshSet meshSet);
+  int getSmallTriangleFirst(const Mesh &mesh, int axis, float minSize);
+  void bindMaterial(Shader &shader, const Mesh &mesh, int textureUnit);
+  void unbindMaterial(int textureUnit);
 
 public:
-  Scene()
+  Scene(SceneStorage _storage = SceneStorage::GPU)
       : gMinX(FLT_MAX), gMinY(FLT_MAX), gMinZ(FLT_MAX), gMaxX(FLT_MIN),
-        gMaxY(FLT_MIN), gMaxZ(FLT_MIN) {
+        gMaxY(FLT_MIN), gMaxZ(FLT_MIN), storage(_storage),
+        staticHash(hashBytes(NULL, 0)) {
     dynamicMeshPosition = glm::vec3(0.0f, 100.0f, 0.0f);
   };
   glm::vec3 dynamicMeshPosition;
   void loadObj(const char *textureDir, const char *filePath, int isDynamic);
   void draw(Shader &shader, int textureUnit);
+  void draw(Shader &shader, int textureUnit, glm::vec3 boundsMin,
+            glm::vec3 boundsMax, MeshSet meshSet = MeshSet::ALL,
+            bool axisBinned = false, float minTriangleSize = 0.0f);
+  void dispatchTriangles(Shader &shader, int textureUnit, glm::vec3 boundsMin,
+                         glm::vec3 boundsMax, MeshSet meshSet,
+                         float maxTriangleSize);
+  void getMeshBounds(const Mesh &mesh, glm::vec3 &boundsMin,
+                     glm::vec3 &boundsMax);
+  void getDynamicBounds(glm::vec3 position, glm::vec3 &boundsMin,
+                        glm::vec3 &boundsMax);
+  void getDynamicShadowBounds(glm::vec3 position, glm::vec3 lightDirection,
+                              glm::vec3 &boundsMin, glm::vec3 &boundsMax);
+  bool getMaterialBounds(size_t materialId, MeshSet meshSet,
+                         glm::vec3 &boundsMin, glm::vec3 &boundsMax);
   glm::vec3 getWorldCenter();
   float getWorldSize();
+  glm::vec3 getWorldExtent();
   std::vector<glm::vec3> getAABB();
+  uint64_t getStaticHash() { return staticHash; }
+  const std::vector<Mesh> &getMeshes() { return meshes; }
+  const Material &getMaterial(size_t id) { return materials[id]; }
+  size_t getMaterialCount() { return materials.size(); }
+  const Image &getImage(int id) { return images[id]; }
 
   glm::vec3 &getFloorSpecularRef() { return materials[floorIdx].ks; }
   glm::vec3 &getFloorEmissiveRef() { return materials[floorIdx].ke; }
@@ -45,6 +85,9 @@ public:
   glm::vec3 &getCurtainEmissiveRef() { return materials[curtainIdx].ke; }
   glm::vec3 &getDynamicSpecularRef() { return materials[dynamicIdx].ks; }
   glm::vec3 &getDynamicEmissiveRef() { return materials[dynamicIdx].ke; }
+  size_t getFloorMaterialId() { return floorIdx; }
+  size_t getCurtainMaterialId() { return curtainIdx; }
+  size_t getDynamicMaterialId() { return dynamicIdx; }
 };
 
 #endif /* ifndef SCENE_H */
@@ -1,6 +1,7 @@
 #include "shader.h"
 
 #include <iostream>
+#include <sstream>
 
 void Shader::printLog(GLuint object) {
   GLint log_length = 0;
@@ -54,16 +55,46 @@ char *Shader::loadFile(const char *filename) {
   return content;
 }
 
-GLuint Shader::initShader(const char *filename, GLenum type) {
-  const GLchar *source = loadFile(filename);
-  if (source == NULL) {
+// Loads a shader source, replacing each #include "file" line with the source
+// of the file, which is looked up next to the including file. A #line after
+// the included source keeps the line numbers of the including file.
+bool Shader::loadSource(const char *filename, std::string &source) {
+  char *content = loadFile(filename);
+  if (content == NULL) {
     fprintf(stderr, "Error opening %s: ", filename);
     perror("");
-    exit(1);
+    return false;
   }
+  std::string directory = filename;
+  directory.erase(directory.find_last_of('/') + 1);
+
+  std::istringstream lines(content);
+  free(content);
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(lines, line)) {
+    lineNumber++;
+    size_t quote = line.find('"');
+    if (line.compare(0, 8, "#include") != 0 || quote == std::string::npos) {
+      source += line + "\n";
+      continue;
+    }
+    std::string include = line.substr(quote + 1);
+    include.erase(include.find('"'));
+    if (!loadSource((directory + include).c_str(), source))
+      return false;
+    source += "#line " + std::to_string(lineNumber + 1) + "\n";
+  }
+  return true;
+}
+
+GLuint Shader::initShader(const char *filename, GLenum type) {
+  std::string source;
+  if (!loadSource(filename, source))
+    exit(1);
+  const GLchar *sourceText = source.c_str();
   GLuint res = glCreateShader(type);
-  glShaderSource(res, 1, &source, NULL);
-  free((void *)source);
+  glShaderSource(res, 1, &sourceText, NULL);
 
   glCompileShader(res);
   GLint compile_ok = GL_FALSE;
@@ -85,6 +116,8 @@ void Shader::attachAndLinkProgram() {
     glAttachShader(program, fs);
   if (gs)
     glAttachShader(program, gs);
+  if (cs)
+    glAttachShader(program, cs);
 
   glLinkProgram(program);
   GLint linked;
@@ -95,7 +128,8 @@ void Shader::attachAndLinkProgram() {
   }
 }
 
-Shader::Shader(const char *vsPath, const char *fsPath, const char *gsPath) {
+Shader::Shader(const char *vsPath, const char *fsPath, const char *gsPath)
+    : vs(0), fs(0), gs(0), cs(0) {
   vsName = vsPath;
   fsName = fsPath;
   if (vsPath)
@@ -110,8 +144,24 @@ Shader::Shader(const char *vsPath, const char *fsPath, const char *gsPath) {
   attachAndLinkProgram();
 }
 
+Shader::Shader(const char *csPath) : vs(0), fs(0), gs(0), cs(0) {
+  vsName = csPath;
+  fsName = csPath;
+  cs = initShader(csPath, GL_COMPUTE_SHADER);
+
+  program = glCreateProgram();
+
+  attachAndLinkProgram();
+}
+
 void Shader::use() { glUseProgram(program); }
 
+// Whether the program uses the uniform, for uniforms only some of the
+// shaders drawing a scene declare.
+bool Shader::hasUniform(const char *name) {
+  return glGetUniformLocation(program, name) != -1;
+}
+
 void Shader::setUniform(uniformType type, void *param, char *name) {
   GLint loc = glGetUniformLocation(program, name);
   if (loc == -1) {
@@ -121,6 +171,10 @@ void Shader::setUniform(uniformType type, void *param, char *name) {
 
   if (type == uniformType::i1) {
     glUniform1i(loc, *((int *)param));
+  } else if (type == uniformType::iv3) {
+    glUniform3iv(loc, 1, (int *)param);
+  } else if (type == uniformType::u1) {
+    glUniform1ui(loc, *((GLuint *)param));
   } else if (type == uniformType::f1) {
     glUniform1f(loc, *((float *)param));
   } else if (type == uniformType::fv3) {
@@ -5,27 +5,32 @@
 
 enum class uniformType {
   i1,
+  iv3,
   fv3,
   fv4,
   f1,
+  u1,
   mat4x4,
   mat3x3,
 };
 
 class Shader {
 private:
-  GLuint vs, fs, gs;
+  GLuint vs, fs, gs, cs;
   GLuint program;
   std::string vsName, fsName;
 
 public:
   Shader(const char *vsPath, const char *fsPath, const char *gsPath = 0);
+  Shader(const char *csPath);
   void use();
   void setUniform(uniformType type, void *param, char *name);
+  bool hasUniform(const char *name);
 
 private:
   void printLog(GLuint object);
   char *loadFile(const char *filename);
+  bool loadSource(const char *filename, std::string &source);
   GLuint initShader(const char *filename, GLenum type);
   void attachAndLinkProgram();
 };
@@ -93,3 +93,13 @@ GLFWwindow *setupWindow(int width, int height) {
 
   return window;
 }
+
+// FNV-1a hash of a block of memory, pass the previous hash to chain blocks.
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
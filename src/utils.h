@@ -13,8 +13,11 @@
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
+#include <cstdint>
 #include <iostream>
 
 GLFWwindow *setupWindow(int width, int height);
+uint64_t hashBytes(const void *data, size_t size,
+                   uint64_t hash = 14695981039346656037ull);
 
 #endif /* ifndef UTILS_H */
@@ -0,0 +1,202 @@
+#include "voxelbake.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const size_t BRICK_BYTES =
+    4 * BAKE_BRICK_DIM * BAKE_BRICK_DIM * BAKE_BRICK_DIM;
+
+glm::ivec3 VoxelBake::getBrickGrid() {
+  glm::ivec3 gridDim(header->gridDim[0], header->gridDim[1],
+                     header->gridDim[2]);
+  return (gridDim + BAKE_BRICK_DIM - 1) / BAKE_BRICK_DIM;
+}
+
+// Writes the three RGBA8 volumes of a grid to a bake. Bricked bakes leave out
+// the bricks whose texels are all empty.
+bool VoxelBake::write(const char *path, uint64_t sceneHash, int voxelDim,
+                      glm::ivec3 gridDim,
+                      const std::vector<unsigned char> *volumes,
+                      bool bricked) {
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    std::cout << "Unable to write voxel bake: " << path << std::endl;
+    return false;
+  }
+
+  VoxelBakeHeader header;
+  memcpy(header.magic, "VXVL", 4);
+  header.version = BAKE_VERSION;
+  header.sceneHash = sceneHash;
+  header.voxelDim = voxelDim;
+  for (int axis = 0; axis < 3; axis++)
+    header.gridDim[axis] = gridDim[axis];
+  header.flags = bricked ? BAKE_BRICKED : 0;
+
+  if (!bricked) {
+    for (int i = 0; i < 3; i++)
+      header.brickCounts[i] = 0;
+    file.write((const char *)&header, sizeof(header));
+    for (int i = 0; i < 3; i++)
+      file.write((const char *)&volumes[i][0], volumes[i].size());
+    return file.good();
+  }
+
+  // Gather the bricks of every volume, zero padded at the grid edges.
+  glm::ivec3 brickGrid = (gridDim + BAKE_BRICK_DIM - 1) / BAKE_BRICK_DIM;
+  std::vector<uint32_t> tables[3];
+  std::vector<unsigned char> bricks[3];
+  std::vector<unsigned char> brick(BRICK_BYTES);
+  for (int i = 0; i < 3; i++) {
+    for (int bz = 0; bz < brickGrid.z; bz++) {
+      for (int by = 0; by < brickGrid.y; by++) {
+        for (int bx = 0; bx < brickGrid.x; bx++) {
+          glm::ivec3 origin = BAKE_BRICK_DIM * glm::ivec3(bx, by, bz);
+          bool empty = true;
+          for (size_t t = 0; t < BRICK_BYTES / 4; t++) {
+            glm::ivec3 coord =
+                origin + glm::ivec3(t % BAKE_BRICK_DIM,
+                                    t / BAKE_BRICK_DIM % BAKE_BRICK_DIM,
+                                    t / (BAKE_BRICK_DIM * BAKE_BRICK_DIM));
+            memset(&brick[4 * t], 0, 4);
+            if (glm::any(glm::greaterThanEqual(coord, gridDim)))
+              continue;
+            size_t index = 4 * (coord.x + gridDim.x * ((size_t)coord.y +
+                                                       gridDim.y * coord.z));
+            memcpy(&brick[4 * t], &volumes[i][index], 4);
+            empty = empty && brick[4 * t + 3] == 0;
+          }
+          if (empty) {
+            tables[i].push_back(0);
+            continue;
+          }
+          bricks[i].insert(bricks[i].end(), brick.begin(), brick.end());
+          tables[i].push_back(bricks[i].size() / BRICK_BYTES);
+        }
+      }
+    }
+    header.brickCounts[i] = bricks[i].size() / BRICK_BYTES;
+  }
+
+  file.write((const char *)&header, sizeof(header));
+  for (int i = 0; i < 3; i++) {
+    file.write((const char *)&tables[i][0], 4 * tables[i].size());
+    if (!bricks[i].empty())
+      file.write((const char *)&bricks[i][0], bricks[i].size());
+  }
+  return file.good();
+}
+
+// Maps a bake into memory. Returns false if it does not exist or is not a
+// valid bake.
+bool VoxelBake::open(const char *path) {
+  close();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      (size_t)info.st_size < sizeof(VoxelBakeHeader)) {
+    ::close(fd);
+    return false;
+  }
+  mappingSize = info.st_size;
+  mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    mapping = NULL;
+    return false;
+  }
+
+  header = (const VoxelBakeHeader *)mapping;
+  if (memcmp(header->magic, "VXVL", 4) != 0 ||
+      header->version != BAKE_VERSION) {
+    std::cout << "Invalid voxel bake: " << path << std::endl;
+    close();
+    return false;
+  }
+
+  glm::ivec3 brickGrid = getBrickGrid();
+  size_t offset = sizeof(VoxelBakeHeader);
+  for (int i = 0; i < 3; i++) {
+    volumeOffsets[i] = offset;
+    if (header->flags & BAKE_BRICKED) {
+      offset += 4 * (size_t)brickGrid.x * brickGrid.y * brickGrid.z;
+      offset += BRICK_BYTES * header->brickCounts[i];
+    } else {
+      offset += 4 * (size_t)header->gridDim[0] * header->gridDim[1] *
+                header->gridDim[2];
+    }
+  }
+  if (offset > mappingSize) {
+    std::cout << "Truncated voxel bake: " << path << std::endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+void VoxelBake::close() {
+  if (mapping)
+    munmap(mapping, mappingSize);
+  mapping = NULL;
+  header = NULL;
+  mappingSize = 0;
+}
+
+// Whether the bake was made from the same static meshes for the same grid.
+bool VoxelBake::matches(uint64_t sceneHash, int voxelDim, glm::ivec3 gridDim) {
+  return header->sceneHash == sceneHash && header->voxelDim == voxelDim &&
+         header->gridDim[0] == gridDim.x && header->gridDim[1] == gridDim.y &&
+         header->gridDim[2] == gridDim.z;
+}
+
+// Uploads a volume of the bake (0 albedo, 1 normal, 2 material) straight
+// from the mapping to level 0 of an RGBA8 texture of the grid size.
+void VoxelBake::upload(int volume, GLuint texture) {
+  const unsigned char *data =
+      (const unsigned char *)mapping + volumeOffsets[volume];
+  glm::ivec3 gridDim(header->gridDim[0], header->gridDim[1],
+                     header->gridDim[2]);
+
+  glBindTexture(GL_TEXTURE_3D, texture);
+  if (!(header->flags & BAKE_BRICKED)) {
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, gridDim.x, gridDim.y,
+                    gridDim.z, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    return;
+  }
+
+  // The bricks that were left out stay empty.
+  GLuint clearColor = 0;
+  glClearTexImage(texture, 0, GL_RGBA, GL_UNSIGNED_BYTE, &clearColor);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, BAKE_BRICK_DIM);
+  glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, BAKE_BRICK_DIM);
+
+  glm::ivec3 brickGrid = getBrickGrid();
+  const uint32_t *table = (const uint32_t *)data;
+  const unsigned char *bricks =
+      data + 4 * (size_t)brickGrid.x * brickGrid.y * brickGrid.z;
+  size_t brick = 0;
+  for (int bz = 0; bz < brickGrid.z; bz++) {
+    for (int by = 0; by < brickGrid.y; by++) {
+      for (int bx = 0; bx < brickGrid.x; bx++, brick++) {
+        if (table[brick] == 0 || table[brick] > header->brickCounts[volume])
+          continue;
+        glm::ivec3 origin = BAKE_BRICK_DIM * glm::ivec3(bx, by, bz);
+        glm::ivec3 size = glm::min(gridDim - origin, BAKE_BRICK_DIM);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, origin.x, origin.y, origin.z,
+                        size.x, size.y, size.z, GL_RGBA, GL_UNSIGNED_BYTE,
+                        bricks + BRICK_BYTES * (table[brick] - 1));
+      }
+    }
+  }
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
@@ -0,0 +1,58 @@
+#ifndef VOXEL_BAKE_H
+#define VOXEL_BAKE_H
+
+#include "utils.h"
+
+#include <vector>
+
+// A voxel bake (.vxvol) keeps the albedo, normal and material volumes of the
+// static meshes of a scene, so the dense grid can skip voxelizing them at
+// startup. The light and the emissive colors are not baked, they are injected
+// into the volumes as usual.
+//
+// Layout, in the byte order of the machine that baked it:
+//   VoxelBakeHeader
+//   for each volume, albedo, normal then material:
+//     bricked: a table of one uint32 per brick of the grid, x varying
+//              fastest, 0 for an empty brick that is not stored or 1 + the
+//              index of the brick, followed by the stored bricks of
+//              BAKE_BRICK_DIM^3 RGBA8 texels, x varying fastest
+//     raw:     the RGBA8 volume, x varying fastest
+const int BAKE_BRICK_DIM = 8;
+const uint32_t BAKE_VERSION = 2;
+const uint32_t BAKE_BRICKED = 1;
+
+struct VoxelBakeHeader {
+  char magic[4]; // "VXVL"
+  uint32_t version;
+  uint64_t sceneHash; // Scene::getStaticHash of the baked scene
+  int32_t voxelDim;   // VOXEL_DIM the grid was fitted for
+  int32_t gridDim[3];
+  uint32_t flags;
+  uint32_t brickCounts[3]; // bricks stored for each volume
+};
+
+class VoxelBake {
+private:
+  void *mapping;
+  size_t mappingSize;
+  const VoxelBakeHeader *header;
+  size_t volumeOffsets[3];
+
+  glm::ivec3 getBrickGrid();
+
+public:
+  VoxelBake() : mapping(NULL), mappingSize(0), header(NULL) {}
+  ~VoxelBake() { close(); }
+
+  static bool write(const char *path, uint64_t sceneHash, int voxelDim,
+                    glm::ivec3 gridDim,
+                    const std::vector<unsigned char> *volumes, bool bricked);
+
+  bool open(const char *path);
+  void close();
+  bool matches(uint64_t sceneHash, int voxelDim, glm::ivec3 gridDim);
+  void upload(int volume, GLuint texture);
+};
+
+#endif /* ifndef VOXEL_BAKE_H */
@@ -1,12 +1,67 @@
 #include "voxelmap.h"
 #include "constants.h"
+#include "voxelbake.h"
+
+// Fits the dense grid to the scene bounds. Every axis gets as many voxels of
+// the target size as it needs, rounded up so the coarsest mip is exact.
+glm::ivec3 VoxelMap::fitGrid(Scene &scene) {
+  glm::vec3 extent = scene.getWorldExtent();
+  float voxelSize = scene.getWorldSize() / VOXEL_DIM;
+  int align = std::min(64, VOXEL_DIM);
+  glm::ivec3 dim;
+  for (int axis = 0; axis < 3; axis++) {
+    dim[axis] = (int)std::ceil(extent[axis] / voxelSize);
+    dim[axis] = (dim[axis] + align - 1) / align * align;
+    dim[axis] = glm::clamp(dim[axis], align, VOXEL_DIM);
+  }
+  return dim;
+}
 
 void VoxelMap::initTexture() {
-  glGenTextures(1, &voxelTexture);
-  glBindTexture(GL_TEXTURE_3D, voxelTexture);
-  glTexStorage3D(GL_TEXTURE_3D, 7, GL_RGBA8, VOXEL_DIM, VOXEL_DIM, VOXEL_DIM);
-  glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, VOXEL_DIM, VOXEL_DIM, VOXEL_DIM, 0,
-               GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  gridDim = fitGrid(scene);
+  staticBaked = false;
+  frontVolume = 0;
+  frontValid = false;
+  for (int i = 0; i < 3; i++)
+    slabTimes[i] = 0.0f;
+  for (int i = 0; i < 2; i++)
+    volumes[i] = DenseVolume();
+  bounceSlice = 0;
+  initVolume(volumes[0]);
+  if (hasBackVolume())
+    initVolume(volumes[1]);
+
+  // The geometry volumes are only accessed as images, they need no mips.
+  glGenTextures(3, geometryTextures);
+  for (int i = 0; i < 3; i++) {
+    glBindTexture(GL_TEXTURE_3D, geometryTextures[i]);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA8, gridDim.x, gridDim.y,
+                   gridDim.z);
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
+  initViews();
+  initOccupancy();
+  initDiffuseCache();
+  if (rigidProxy)
+    initProxy();
+}
+
+void VoxelMap::releaseTexture() {
+  cancelRebuild();
+  releaseViews();
+  releaseOccupancy();
+  releaseDiffuseCache();
+  releaseProxy();
+  for (int i = 0; i < 2; i++)
+    releaseVolume(volumes[i]);
+  glDeleteTextures(3, geometryTextures);
+}
+
+void VoxelMap::initVolume(DenseVolume &volume) {
+  glGenTextures(1, &volume.voxelTexture);
+  glBindTexture(GL_TEXTURE_3D, volume.voxelTexture);
+  glTexStorage3D(GL_TEXTURE_3D, getMipLevels(), getInternalFormat(), gridDim.x,
+                 gridDim.y, gridDim.z);
 
   // LOD settings for mipmapping.
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER,
@@ -16,27 +71,819 @@ void VoxelMap::initTexture() {
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+  // Formats without alpha keep the opacity in a volume with the same mips.
+  if (hasSeparateOpacity()) {
+    glGenTextures(1, &volume.opacityTexture);
+    glBindTexture(GL_TEXTURE_3D, volume.opacityTexture);
+    glTexStorage3D(GL_TEXTURE_3D, getMipLevels(), GL_R8, gridDim.x, gridDim.y,
+                   gridDim.z);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
+
+  if (anisotropic)
+    initDirectionalTexture(volume);
+}
+
+void VoxelMap::releaseVolume(DenseVolume &volume) {
+  if (volume.voxelTexture == 0)
+    return;
+  glDeleteTextures(1, &volume.voxelTexture);
+  volume.voxelTexture = 0;
+  if (volume.opacityTexture != 0) {
+    glDeleteTextures(1, &volume.opacityTexture);
+    volume.opacityTexture = 0;
+  }
+  releaseDirectionalTexture(volume);
+}
+
+// The directional volumes replace mips 1 and up of the voxel texture, so they
+// have one level less.
+void VoxelMap::initDirectionalTexture(DenseVolume &volume) {
+  glm::ivec3 dim = glm::max(gridDim / 2, 1);
+  int levels = std::max(getMipLevels() - 1, 1);
+
+  glGenTextures(1, &volume.directionalTexture);
+  glBindTexture(GL_TEXTURE_3D, volume.directionalTexture);
+  glTexStorage3D(GL_TEXTURE_3D, levels, getDirectionalFormat(), 6 * dim.x,
+                 dim.y, dim.z);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void VoxelMap::releaseDirectionalTexture(DenseVolume &volume) {
+  if (volume.directionalTexture == 0)
+    return;
+  glDeleteTextures(1, &volume.directionalTexture);
+  volume.directionalTexture = 0;
+}
+
+void VoxelMap::setAnisotropic(bool _anisotropic) {
+  if (anisotropic == _anisotropic)
+    return;
+  anisotropic = _anisotropic;
+  if (backend != VoxelBackend::DENSE)
+    return;
+
+  // The back volume gets its directional mips when it is rebuilt, or in the
+  // next bounce sweep.
+  bounceSlice = 0;
+  releaseViews();
+  for (int i = 0; i < 2; i++) {
+    if (volumes[i].voxelTexture == 0)
+      continue;
+    if (anisotropic) {
+      initDirectionalTexture(volumes[i]);
+    } else {
+      releaseDirectionalTexture(volumes[i]);
+    }
+  }
+  if (anisotropic)
+    updateDirectionalRegion(front(), glm::ivec3(0), gridDim);
+  initViews();
+  if (isRebuilding()) {
+    queueRebuild(RebuildStage::MIPMAPS, rebuildLightPosition,
+                 rebuildLightColor, rebuildHasShadows);
+  }
+}
+
+// Allocating the back volume doubles the memory of the lit volumes, without
+// it every rebuild is done in the front volume within one frame.
+void VoxelMap::setDoubleBuffered(bool _doubleBuffered) {
+  if (doubleBuffered == _doubleBuffered)
+    return;
+  doubleBuffered = _doubleBuffered;
+  if (backend != VoxelBackend::DENSE)
+    return;
+
+  if (doubleBuffered) {
+    if (back().voxelTexture == 0)
+      initVolume(back());
+    return;
+  }
+  cancelRebuild();
+  if (!hasBackVolume())
+    releaseVolume(back());
+}
+
+// The bounces are lit into the back volume, which is allocated for them if
+// the volumes are not double buffered anyway.
+void VoxelMap::setMultiBounce(bool _multiBounce) {
+  if (multiBounce == _multiBounce)
+    return;
+  multiBounce = _multiBounce;
+  bounceSlice = 0;
+  if (backend != VoxelBackend::DENSE || doubleBuffered)
+    return;
+
+  if (multiBounce) {
+    initVolume(back());
+    return;
+  }
+  releaseVolume(back());
+}
+
+// Fits a cube of voxels of the grid size around the dynamic meshes in object
+// space, with a voxel of padding so the mips fade out at the edges. Larger
+// meshes get coarser voxels.
+void VoxelMap::initProxy() {
+  const int MAX_PROXY_DIM = 128;
+  glm::vec3 boundsMin, boundsMax;
+  scene.getDynamicBounds(glm::vec3(0.0f), boundsMin, boundsMax);
+  if (boundsMin.x > boundsMax.x)
+    return;
+
+  proxyVoxelSize = getGridVoxelSize();
+  glm::vec3 extent = boundsMax - boundsMin + 2.0f * proxyVoxelSize;
+  float size = glm::max(extent.x, glm::max(extent.y, extent.z));
+  proxyDim = 4;
+  while (proxyDim < MAX_PROXY_DIM && proxyDim * proxyVoxelSize < size)
+    proxyDim *= 2;
+  proxyVoxelSize = glm::max(proxyVoxelSize, size / proxyDim);
+  proxyLocalMin = 0.5f * (boundsMin + boundsMax) -
+                  glm::vec3(0.5f * proxyDim * proxyVoxelSize);
+
+  int levels = 1;
+  while ((proxyDim >> levels) > 0)
+    levels++;
+  glGenTextures(1, &proxyTexture);
+  glBindTexture(GL_TEXTURE_3D, proxyTexture);
+  glTexStorage3D(GL_TEXTURE_3D, levels, GL_RGBA8, proxyDim, proxyDim,
+                 proxyDim);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  // Cones sampling next to the proxy see empty space.
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+
+  glGenTextures(3, proxyGeometryTextures);
+  for (int i = 0; i < 3; i++) {
+    glBindTexture(GL_TEXTURE_3D, proxyGeometryTextures[i]);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA8, proxyDim, proxyDim, proxyDim);
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void VoxelMap::releaseProxy() {
+  if (proxyTexture == 0)
+    return;
+  glDeleteTextures(1, &proxyTexture);
+  glDeleteTextures(3, proxyGeometryTextures);
+  proxyTexture = 0;
+}
+
+void VoxelMap::initOccupancy() {
+  occupancyDim = glm::max(gridDim / OCCUPANCY_BLOCK_DIM, 1);
+  glGenBuffers(1, &occupancyBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, getOccupancyBytes(), NULL,
+               GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  glGenTextures(1, &distanceTexture);
+  glBindTexture(GL_TEXTURE_3D, distanceTexture);
+  glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32F, occupancyDim.x, occupancyDim.y,
+                 occupancyDim.z);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glGenTextures(2, transformTextures);
+  for (int i = 0; i < 2; i++) {
+    glBindTexture(GL_TEXTURE_3D, transformTextures[i]);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32UI, occupancyDim.x, occupancyDim.y,
+                   occupancyDim.z);
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void VoxelMap::releaseOccupancy() {
+  if (distanceTexture == 0)
+    return;
+  glDeleteBuffers(1, &occupancyBuffer);
+  glDeleteTextures(1, &distanceTexture);
+  glDeleteTextures(2, transformTextures);
+  distanceTexture = 0;
+}
+
+// Size of the occupancy mask, a uvec2 per block of every level.
+size_t VoxelMap::getOccupancyBytes() {
+  size_t bytes = 0;
+  glm::ivec3 dim = glm::max(gridDim / OCCUPANCY_BLOCK_DIM, 1);
+  for (int level = 0; level < OCCUPANCY_LEVELS; level++) {
+    bytes += 8 * (size_t)dim.x * dim.y * dim.z;
+    dim = glm::max(dim / OCCUPANCY_BLOCK_DIM, 1);
+  }
+  return bytes;
+}
+
+// Rebuilds the occupancy mask from the base level of the front volume and
+// the bounds of the proxy, then the distance field from its first level.
+void VoxelMap::updateOccupancy() {
+  if (backend != VoxelBackend::DENSE || !frontValid)
+    return;
+  GLuint voxelTextureUnit = 0;
+  GLuint opacityUnit = 1;
+  int separateOpacity = hasSeparateOpacity();
+  int hasProxy = useProxy();
+  glm::vec3 proxyMin(0.0f), proxyMax(0.0f);
+  if (hasProxy) {
+    glm::vec3 gridMin = scene.getWorldCenter() - getGridSizeHalf();
+    proxyMin = (proxyLocalMin + scene.dynamicMeshPosition - gridMin) /
+               getGridVoxelSize();
+    proxyMax = proxyMin + proxyDim * proxyVoxelSize / getGridVoxelSize();
+  }
+  occupancyShader.use();
+  occupancyShader.setUniform(uniformType::i1, &voxelTextureUnit,
+                             "voxelTexture");
+  occupancyShader.setUniform(uniformType::i1, &opacityUnit, "opacityTexture");
+  occupancyShader.setUniform(uniformType::i1, &separateOpacity,
+                             "separateOpacity");
+  occupancyShader.setUniform(uniformType::i1, &hasProxy, "hasProxy");
+  occupancyShader.setUniform(uniformType::fv3, glm::value_ptr(proxyMin),
+                             "proxyMin");
+  occupancyShader.setUniform(uniformType::fv3, glm::value_ptr(proxyMax),
+                             "proxyMax");
+  occupancyShader.setUniform(uniformType::iv3, glm::value_ptr(occupancyDim),
+                             "occupancyDim");
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_3D, front().voxelTexture);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_3D, front().opacityTexture);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, occupancyBuffer);
+
+  // Each level ORs the bits of the level below.
+  glm::ivec3 dim = occupancyDim;
+  for (int level = 0; level < OCCUPANCY_LEVELS; level++) {
+    glm::ivec3 groups = (dim + 3) / 4;
+    occupancyShader.setUniform(uniformType::i1, &level, "level");
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    dim = glm::max(dim / OCCUPANCY_BLOCK_DIM, 1);
+  }
+  updateDistanceField();
+}
+
+// Marks the blocks of the first level of the occupancy mask that have a bit
+// set, transforms them into the exact squared distance to the nearest of
+// them along each axis in turn, and resolves that to a distance. Unlike a
+// jump flood the distances are never too large, so skips based on them
+// cannot step past a voxel.
+void VoxelMap::updateDistanceField() {
+  float cellSize = OCCUPANCY_BLOCK_DIM * getGridVoxelSize();
+  distanceShader.use();
+  distanceShader.setUniform(uniformType::f1, &cellSize, "cellSize");
+  glm::ivec3 groups = (occupancyDim + 3) / 4;
+
+  int stage = 0;
+  distanceShader.setUniform(uniformType::i1, &stage, "stage");
+  glBindImageTexture(1, transformTextures[0], 0, GL_TRUE, 0, GL_WRITE_ONLY,
+                     GL_R32UI);
+  glDispatchCompute(groups.x, groups.y, groups.z);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+  int source = 0;
+  stage = 1;
+  distanceShader.setUniform(uniformType::i1, &stage, "stage");
+  for (int axis = 0; axis < 3; axis++) {
+    glBindImageTexture(0, transformTextures[source], 0, GL_TRUE, 0,
+                       GL_READ_ONLY, GL_R32UI);
+    glBindImageTexture(1, transformTextures[1 - source], 0, GL_TRUE, 0,
+                       GL_WRITE_ONLY, GL_R32UI);
+    distanceShader.setUniform(uniformType::i1, &axis, "axis");
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    source = 1 - source;
+  }
+
+  stage = 2;
+  distanceShader.setUniform(uniformType::i1, &stage, "stage");
+  glBindImageTexture(0, transformTextures[source], 0, GL_TRUE, 0, GL_READ_ONLY,
+                     GL_R32UI);
+  glBindImageTexture(2, distanceTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY,
+                     GL_R32F);
+  glDispatchCompute(groups.x, groups.y, groups.z);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                  GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Makes the volume of the irradiance cache or the probe grid, whichever is
+// in use.
+void VoxelMap::initDiffuseCache() {
+  irradianceSlice = 0;
+  nextProbe = 0;
+  irradianceValid = false;
+  glm::ivec3 dim;
+  if (diffuseCache == DiffuseCache::VOXELS) {
+    dim = occupancyDim;
+  } else if (diffuseCache == DiffuseCache::PROBES) {
+    // The probes are spread further apart than asked if there would be more
+    // than MAX_PROBE_DIM of them along an axis.
+    std::vector<glm::vec3> aabb = scene.getAABB();
+    glm::vec3 extent = aabb[7] - aabb[0];
+    float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+    probeWorldSpacing = std::max(probeSpacing * getGridVoxelSize(),
+                                 maxExtent / (MAX_PROBE_DIM - 1));
+    probeDim = glm::ivec3(glm::ceil(extent / probeWorldSpacing)) + 1;
+    probeDim = glm::clamp(probeDim, 2, MAX_PROBE_DIM);
+    probeMin = aabb[0];
+    dim = probeDim;
+  } else {
+    return;
+  }
+
+  glGenTextures(1, &irradianceTexture);
+  glBindTexture(GL_TEXTURE_3D, irradianceTexture);
+  glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA16F, 6 * dim.x, dim.y, dim.z);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void VoxelMap::releaseDiffuseCache() {
+  if (irradianceTexture == 0)
+    return;
+  glDeleteTextures(1, &irradianceTexture);
+  irradianceTexture = 0;
+}
+
+void VoxelMap::setDiffuseCache(DiffuseCache _diffuseCache) {
+  if (diffuseCache == _diffuseCache)
+    return;
+  releaseDiffuseCache();
+  diffuseCache = _diffuseCache;
+  initDiffuseCache();
+}
+
+void VoxelMap::setProbeSpacing(int _probeSpacing) {
+  probeSpacing = _probeSpacing;
+  if (diffuseCache != DiffuseCache::PROBES)
+    return;
+  releaseDiffuseCache();
+  initDiffuseCache();
+}
+
+// Sets up the cone tracing of the irradiance cache and the probe grid, they
+// sample the front volume and write to the same image.
+void VoxelMap::beginIrradianceTrace(float voxelSize) {
+  glm::vec3 worldCenter = scene.getWorldCenter();
+  glm::vec3 worldSizeHalf = getGridSizeHalf();
+  int filter = (int)mipmapFilter;
+  int anisotropicVoxels = anisotropic;
+  GLuint voxelTextureUnit = 0;
+  GLuint directionalUnit = 2;
+  irradianceShader.use();
+  irradianceShader.setUniform(uniformType::fv3, glm::value_ptr(worldCenter),
+                              "worldCenter");
+  irradianceShader.setUniform(uniformType::fv3, glm::value_ptr(worldSizeHalf),
+                              "worldSizeHalf");
+  irradianceShader.setUniform(uniformType::f1, &voxelSize, "voxelSize");
+  irradianceShader.setUniform(uniformType::i1, &filter, "mipmapFilter");
+  irradianceShader.setUniform(uniformType::i1, &anisotropicVoxels,
+                              "anisotropicVoxels");
+  irradianceShader.setUniform(uniformType::i1, &voxelTextureUnit,
+                              "voxelTexture");
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_3D, voxelView);
+  bindOpacity(irradianceShader, 1);
+  irradianceShader.setUniform(uniformType::i1, &directionalUnit,
+                              "directionalVoxels");
+  glActiveTexture(GL_TEXTURE0 + directionalUnit);
+  glBindTexture(GL_TEXTURE_3D, directionalView);
+  bindProxy(irradianceShader, 3, voxelSize);
+  glBindImageTexture(0, irradianceTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY,
+                     GL_RGBA16F);
+}
+
+// Traces the next slices of the irradiance cache, or all of them if it has
+// not been filled since the volumes were made.
+void VoxelMap::updateIrradianceCache(float voxelSize) {
+  glm::ivec3 regionMin(0, 0, irradianceValid ? irradianceSlice : 0);
+  glm::ivec3 regionMax = occupancyDim;
+  if (irradianceValid)
+    regionMax.z = std::min(regionMin.z + irradianceSlices, occupancyDim.z);
+  irradianceSlice = regionMax.z % occupancyDim.z;
+  irradianceValid = true;
+
+  beginIrradianceTrace(voxelSize);
+  float blockSize = OCCUPANCY_BLOCK_DIM * getGridVoxelSize();
+  int probeGrid = 0;
+  irradianceShader.setUniform(uniformType::i1, &probeGrid, "probeGrid");
+  irradianceShader.setUniform(uniformType::f1, &blockSize, "blockSize");
+  irradianceShader.setUniform(uniformType::iv3, glm::value_ptr(occupancyDim),
+                              "occupancyDim");
+  irradianceShader.setUniform(uniformType::iv3, glm::value_ptr(regionMin),
+                              "regionMin");
+  irradianceShader.setUniform(uniformType::iv3, glm::value_ptr(regionMax),
+                              "regionMax");
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, occupancyBuffer);
+
+  glm::ivec3 groups = (regionMax - regionMin + 3) / 4;
+  glDispatchCompute(groups.x, groups.y, groups.z);
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Traces the next probesPerFrame probes in x fastest order, or all of them
+// if the grid has not been filled since the volumes were made.
+void VoxelMap::updateProbes(float voxelSize) {
+  int probes = probeDim.x * probeDim.y * probeDim.z;
+  int firstProbe = irradianceValid ? nextProbe : 0;
+  int probeCount = probes;
+  if (irradianceValid)
+    probeCount = std::min(probesPerFrame, probes - firstProbe);
+  nextProbe = (firstProbe + probeCount) % probes;
+  irradianceValid = true;
+
+  beginIrradianceTrace(voxelSize);
+  int probeGrid = 1;
+  irradianceShader.setUniform(uniformType::i1, &probeGrid, "probeGrid");
+  irradianceShader.setUniform(uniformType::iv3, glm::value_ptr(probeDim),
+                              "probeDim");
+  irradianceShader.setUniform(uniformType::fv3, glm::value_ptr(probeMin),
+                              "probeMin");
+  irradianceShader.setUniform(uniformType::f1, &probeWorldSpacing,
+                              "probeSpacing");
+  irradianceShader.setUniform(uniformType::i1, &firstProbe, "firstProbe");
+  irradianceShader.setUniform(uniformType::i1, &probeCount, "probeCount");
+
+  glDispatchCompute((probeCount + 63) / 64, 1, 1);
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Tells the shader whether cones can skip empty space and binds the
+// occupancy mask and the distance field for it.
+void VoxelMap::bindOccupancy(Shader &shader, GLuint unit) {
+  int skip = skipEmptySpace && backend == VoxelBackend::DENSE && frontValid;
+  shader.setUniform(uniformType::i1, &skip, "skipEmptySpace");
+  shader.setUniform(uniformType::i1, &unit, "distanceField");
+  if (!skip)
+    return;
+
+  float voxelSize = getGridVoxelSize();
+  shader.setUniform(uniformType::f1, &voxelSize, "occupancyVoxelSize");
+  shader.setUniform(uniformType::iv3, glm::value_ptr(occupancyDim),
+                    "occupancyDim");
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, occupancyBuffer);
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_3D, distanceTexture);
+}
+
+// The dynamic meshes are voxelized into the dense grid again when the proxy
+// is turned off, the caller revoxelizes.
+void VoxelMap::setRigidProxy(bool _rigidProxy) {
+  if (rigidProxy == _rigidProxy)
+    return;
+  rigidProxy = _rigidProxy;
+  if (backend != VoxelBackend::DENSE)
+    return;
+  if (rigidProxy) {
+    initProxy();
+  } else {
+    releaseProxy();
+  }
+}
+
+// Views of the dense volumes starting at the traced resolution. The
+// directional volumes start one level lower, their level 0 is mip 1.
+void VoxelMap::initViews() {
+  DenseVolume &volume = front();
+  int levels = std::max(getMipLevels() - resolutionLevel, 1);
+  glGenTextures(1, &voxelView);
+  glTextureView(voxelView, GL_TEXTURE_3D, volume.voxelTexture,
+                getInternalFormat(), resolutionLevel, levels, 0, 1);
+  if (volume.opacityTexture != 0) {
+    glGenTextures(1, &opacityView);
+    glTextureView(opacityView, GL_TEXTURE_3D, volume.opacityTexture, GL_R8,
+                  resolutionLevel, levels, 0, 1);
+  }
+  if (volume.directionalTexture != 0) {
+    GLint directionalLevels;
+    glBindTexture(GL_TEXTURE_3D, volume.directionalTexture);
+    glGetTexParameteriv(GL_TEXTURE_3D, GL_TEXTURE_IMMUTABLE_LEVELS,
+                        &directionalLevels);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glGenTextures(1, &directionalView);
+    glTextureView(directionalView, GL_TEXTURE_3D, volume.directionalTexture,
+                  getDirectionalFormat(), resolutionLevel,
+                  std::max(directionalLevels - resolutionLevel, 1), 0, 1);
+  }
+
+  // A view starts with the default sampling state.
+  GLuint views[3] = {voxelView, opacityView, directionalView};
+  for (int i = 0; i < 3; i++) {
+    if (views[i] == 0)
+      continue;
+    glBindTexture(GL_TEXTURE_3D, views[i]);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  }
   glBindTexture(GL_TEXTURE_3D, 0);
 }
 
+void VoxelMap::releaseViews() {
+  GLuint views[3] = {voxelView, opacityView, directionalView};
+  for (int i = 0; i < 3; i++) {
+    if (views[i] != 0)
+      glDeleteTextures(1, &views[i]);
+  }
+  voxelView = opacityView = directionalView = 0;
+}
+
+// Traces a grid of half the resolution per level, taken from the mips of the
+// finest voxelization. Nothing has to be voxelized again.
+void VoxelMap::setResolutionLevel(int level) {
+  level = glm::clamp(level, 0, 3);
+  if (level == resolutionLevel)
+    return;
+  resolutionLevel = level;
+  if (backend != VoxelBackend::DENSE)
+    return;
+  releaseViews();
+  initViews();
+}
+
+GLenum VoxelMap::getInternalFormat() {
+  if (voxelFormat == VoxelFormat::R11G11B10F)
+    return GL_R11F_G11F_B10F;
+  if (voxelFormat == VoxelFormat::RGBA16F)
+    return GL_RGBA16F;
+  return GL_RGBA8;
+}
+
+// The directional volumes need an alpha channel in every format.
+GLenum VoxelMap::getDirectionalFormat() {
+  return voxelFormat == VoxelFormat::RGBA8 ? GL_RGBA8 : GL_RGBA16F;
+}
+
+void VoxelMap::setVoxelFormat(VoxelFormat _voxelFormat) {
+  if (voxelFormat == _voxelFormat)
+    return;
+  voxelFormat = _voxelFormat;
+  resizeTexture();
+}
+
 void VoxelMap::resizeTexture() {
-  glDeleteTextures(1, &voxelTexture);
+  if (backend != VoxelBackend::DENSE)
+    return;
+  releaseTexture();
   initTexture();
 }
 
-void VoxelMap::clear() {
-  GLuint clearColor = 0;
-  glBindTexture(GL_TEXTURE_3D, voxelTexture);
-  glClearTexImage(voxelTexture, 0, GL_RGBA, GL_UNSIGNED_BYTE, &clearColor);
+void VoxelMap::initClipmap() {
+  clipmapTextures.resize(CLIPMAP_LEVELS);
+  clipmapOrigins.assign(CLIPMAP_LEVELS, glm::ivec3(0));
+  glGenTextures(CLIPMAP_LEVELS, &clipmapTextures[0]);
+  for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+    glBindTexture(GL_TEXTURE_3D, clipmapTextures[level]);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_RGBA8, CLIPMAP_DIM, CLIPMAP_DIM,
+                   CLIPMAP_DIM);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // Toroidal addressing wraps around the texture edges.
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
 }
 
-void VoxelMap::voxelize(glm::vec3 lightPosition, glm::vec3 lightColor,
-                        int hasShadows) {
-  clear();
+void VoxelMap::releaseClipmap() {
+  glDeleteTextures(CLIPMAP_LEVELS, &clipmapTextures[0]);
+  clipmapTextures.clear();
+  clipmapOrigins.clear();
+}
 
+void VoxelMap::setBackend(VoxelBackend _backend) {
+  if (backend == _backend)
+    return;
+  octreeFull = false;
+
+  // Only one backend keeps its storage allocated at a time.
+  if (backend == VoxelBackend::DENSE) {
+    releaseTexture();
+  } else if (backend == VoxelBackend::OCTREE) {
+    octree.releaseBuffers();
+  } else if (backend == VoxelBackend::CLIPMAP) {
+    releaseClipmap();
+  }
+
+  // The storage of the new backend depends on it, e.g. the separate opacity
+  // volume of the dense grid.
+  backend = _backend;
+  if (backend == VoxelBackend::DENSE) {
+    initTexture();
+  } else if (backend == VoxelBackend::OCTREE) {
+    octree.initBuffers();
+  } else if (backend == VoxelBackend::CLIPMAP) {
+    initClipmap();
+  }
+}
+
+size_t VoxelMap::getMemoryUsage() {
+  if (backend == VoxelBackend::OCTREE)
+    return octree.getMemoryUsage();
+
+  if (backend == VoxelBackend::CLIPMAP) {
+    size_t dim = CLIPMAP_DIM;
+    return CLIPMAP_LEVELS * 4 * dim * dim * dim;
+  }
+
+  return getDenseMemoryUsage(voxelFormat);
+}
+
+// Memory the dense grid takes when stored in the given format.
+size_t VoxelMap::getDenseMemoryUsage(VoxelFormat format) {
+  size_t texelBytes = format == VoxelFormat::RGBA16F ? 8 : 4;
+  if (format == VoxelFormat::R11G11B10F)
+    texelBytes += 1; // opacity
+  size_t directionalBytes = format == VoxelFormat::RGBA8 ? 4 : 8;
+
+  // Albedo, normal and material of the static meshes at the base resolution.
+  size_t texels = (size_t)gridDim.x * gridDim.y * gridDim.z;
+  size_t bytes = 3 * 4 * texels;
+  size_t litBytes = 0;
+  for (int level = 0; level < getMipLevels(); level++) {
+    glm::ivec3 dim = glm::max(gridDim >> level, 1);
+    size_t texels = (size_t)dim.x * dim.y * dim.z;
+    litBytes += texelBytes * texels;
+    if (anisotropic && level > 0)
+      litBytes += 6 * directionalBytes * texels;
+  }
+  bytes += (hasBackVolume() ? 2 : 1) * litBytes;
+
+  // The occupancy mask, the distance field and the two volumes it is
+  // transformed in.
+  glm::ivec3 cells = glm::max(gridDim / OCCUPANCY_BLOCK_DIM, 1);
+  size_t cellCount = (size_t)cells.x * cells.y * cells.z;
+  bytes += getOccupancyBytes() + 3 * 4 * cellCount;
+
+  // Six RGBA16F texels per block of the irradiance cache or per probe.
+  if (diffuseCache == DiffuseCache::VOXELS)
+    bytes += 6 * 8 * cellCount;
+  else if (diffuseCache == DiffuseCache::PROBES)
+    bytes += 6 * 8 * (size_t)probeDim.x * probeDim.y * probeDim.z;
+
+  // The proxy is RGBA8 with mips, next to its three geometry volumes.
+  if (useProxy()) {
+    size_t proxyTexels = (size_t)proxyDim * proxyDim * proxyDim;
+    bytes += 4 * proxyTexels * 8 / 7 + 3 * 4 * proxyTexels;
+  }
+  return bytes;
+}
+
+// Binds the storage of the octree and clipmap backends to texture units
+// starting at firstUnit, and tells the shader which backend to sample.
+void VoxelMap::bindBackend(Shader &shader, GLuint firstUnit) {
+  int voxelBackend = (int)backend;
+  shader.setUniform(uniformType::i1, &voxelBackend, "voxelBackend");
+  if (backend == VoxelBackend::OCTREE)
+    octree.bind(shader, firstUnit);
+
+  shader.setUniform(uniformType::i1, (void *)&CLIPMAP_DIM, "clipmapDim");
+  shader.setUniform(uniformType::f1, &clipmapVoxelSize, "clipmapVoxelSize");
+  for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+    std::string index = "[" + std::to_string(level) + "]";
+    GLuint unit = firstUnit + 1 + level;
+    shader.setUniform(uniformType::i1, &unit,
+                      (char *)("clipmapLevels" + index).c_str());
+    if (backend != VoxelBackend::CLIPMAP)
+      continue;
+
+    glm::vec3 levelMin =
+        glm::vec3(clipmapOrigins[level]) * getClipmapVoxelSize(level);
+    shader.setUniform(uniformType::fv3, glm::value_ptr(levelMin),
+                      (char *)("clipmapMin" + index).c_str());
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_3D, clipmapTextures[level]);
+  }
+}
+
+// Binds the opacity volume of voxel formats without alpha.
+void VoxelMap::bindOpacity(Shader &shader, GLuint unit) {
+  int separateOpacity = hasSeparateOpacity();
+  shader.setUniform(uniformType::i1, &separateOpacity, "separateOpacity");
+  shader.setUniform(uniformType::i1, &unit, "opacityTexture");
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_3D, opacityView);
+}
+
+// Binds the proxy and the transform from world space to its texture
+// coordinates. Its lod is offset by the size of its voxels relative to the
+// traced voxel size.
+void VoxelMap::bindProxy(Shader &shader, GLuint unit, float voxelSize) {
+  int hasProxy = useProxy();
+  shader.setUniform(uniformType::i1, &hasProxy, "hasProxy");
+  shader.setUniform(uniformType::i1, &unit, "proxyVolume");
+  if (!hasProxy)
+    return;
+
+  glm::vec3 proxyMin = proxyLocalMin + scene.dynamicMeshPosition;
+  float proxySize = proxyDim * proxyVoxelSize;
+  glm::mat4 proxyInverse =
+      glm::scale(glm::mat4(1.0f), glm::vec3(1.0f / proxySize));
+  proxyInverse = glm::translate(proxyInverse, -proxyMin);
+  float lodOffset = std::log2(voxelSize / proxyVoxelSize);
+  shader.setUniform(uniformType::mat4x4, glm::value_ptr(proxyInverse),
+                    "proxyInverse");
+  shader.setUniform(uniformType::f1, &lodOffset, "proxyLodOffset");
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_3D, proxyTexture);
+}
+
+// Reads back the base level of a geometry volume of the dense grid (0 albedo,
+// 1 normal, 2 material) as RGBA8 texels, x varying fastest.
+std::vector<unsigned char> VoxelMap::readGeometryVolume(int volume) {
+  std::vector<unsigned char> texels(4 * (size_t)gridDim.x * gridDim.y *
+                                    gridDim.z);
+  glBindTexture(GL_TEXTURE_3D, geometryTextures[volume]);
+  glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_UNSIGNED_BYTE, &texels[0]);
+  glBindTexture(GL_TEXTURE_3D, 0);
+  return texels;
+}
+
+// Builds the mips of a geometry volume of the dense grid with the mip pass of
+// the lit volumes and reads back all levels, the base level first. The
+// geometry volumes keep no mips, a copy is filtered.
+std::vector<std::vector<unsigned char>>
+VoxelMap::readGeometryMipmaps(int volume) {
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_3D, texture);
+  glTexStorage3D(GL_TEXTURE_3D, getMipLevels(), GL_RGBA8, gridDim.x,
+                 gridDim.y, gridDim.z);
+  glCopyImageSubData(geometryTextures[volume], GL_TEXTURE_3D, 0, 0, 0, 0,
+                     texture, GL_TEXTURE_3D, 0, 0, 0, 0, gridDim.x, gridDim.y,
+                     gridDim.z);
+  updateMipLevels(texture, GL_RGBA8, 0, glm::ivec3(0), gridDim);
+
+  std::vector<std::vector<unsigned char>> mips;
+  glBindTexture(GL_TEXTURE_3D, texture);
+  for (int level = 0; level < getMipLevels(); level++) {
+    glm::ivec3 dim = glm::max(gridDim >> level, 1);
+    mips.push_back(
+        std::vector<unsigned char>(4 * (size_t)dim.x * dim.y * dim.z));
+    glGetTexImage(GL_TEXTURE_3D, level, GL_RGBA, GL_UNSIGNED_BYTE,
+                  &mips.back()[0]);
+  }
+  glBindTexture(GL_TEXTURE_3D, 0);
+  glDeleteTextures(1, &texture);
+  return mips;
+}
+
+// Loads the geometry volumes of the static meshes from a bake made for this
+// scene and grid, the next voxelize() then only injects the light. Returns
+// false if the bake is missing or stale.
+bool VoxelMap::loadBake(const char *path) {
+  if (backend != VoxelBackend::DENSE)
+    return false;
+  VoxelBake bake;
+  if (!bake.open(path))
+    return false;
+  if (!bake.matches(scene.getStaticHash(), VOXEL_DIM, gridDim)) {
+    std::cout << "Voxel bake is stale: " << path << std::endl;
+    return false;
+  }
+
+  for (int i = 0; i < 3; i++)
+    bake.upload(i, geometryTextures[i]);
+  staticBaked = true;
+  std::cout << "Loaded voxel bake: " << path << std::endl;
+  return true;
+}
+
+void VoxelMap::clear(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+  GLuint clearColor = 0;
+  glm::ivec3 size = regionMax - regionMin;
+  for (int i = 0; i < 3; i++) {
+    glClearTexSubImage(geometryTextures[i], 0, regionMin.x, regionMin.y,
+                       regionMin.z, size.x, size.y, size.z, GL_RGBA,
+                       GL_UNSIGNED_BYTE, &clearColor);
+  }
+}
+
+void VoxelMap::beginVoxelize(glm::vec3 lightPosition, glm::vec3 lightColor,
+                             int hasShadows) {
   glm::mat4 modelT = glm::mat4(1.0f);
-  glm::vec3 worldCenter = scene.getWorldCenter();
-  float worldSizeHalf = 0.5f * scene.getWorldSize();
   GLuint voxelTextureUnit = 0;
   GLuint shadowMapUnit = 1;
 
@@ -44,37 +891,167 @@ void VoxelMap::voxelize(glm::vec3 lightPosition, glm::vec3 lightColor,
   glDisable(GL_DEPTH_TEST);
   glDisable(GL_BLEND);
 
-  voxelizeShader.use();
-  glBindImageTexture(0, voxelTexture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA8);
-  voxelizeShader.setUniform(uniformType::mat4x4, glm::value_ptr(modelT), "M");
-  voxelizeShader.setUniform(uniformType::i1, &voxelTextureUnit, "voxelTexture");
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_3D, voxelTexture);
+  voxelizeShader().use();
+  setVoxelizeUniform(uniformType::mat4x4, glm::value_ptr(modelT), "M");
+  setVoxelizeUniform(uniformType::i1, &voxelTextureUnit, "voxelTexture");
+
+  int voxelTarget = backend == VoxelBackend::OCTREE;
+  setVoxelizeUniform(uniformType::i1, &voxelTarget, "voxelTarget");
+  int average = isAveraging();
+  setVoxelizeUniform(uniformType::i1, &average, "averageVoxels");
+  int accumulationDepth = ACCUMULATION_DEPTH;
+  setVoxelizeUniform(uniformType::i1, &accumulationDepth, "accumulationDepth");
+  int format = backend == VoxelBackend::DENSE ? (int)voxelFormat : 0;
+  setVoxelizeUniform(uniformType::i1, &format, "voxelFormat");
 
   GLuint shads = hasShadows;
-  voxelizeShader.setUniform(uniformType::i1, &shads, "hasShadows");
-  voxelizeShader.setUniform(uniformType::fv3, glm::value_ptr(worldCenter),
-                            "worldCenter");
-  voxelizeShader.setUniform(uniformType::f1, &worldSizeHalf, "worldSizeHalf");
-  voxelizeShader.setUniform(uniformType::fv3, glm::value_ptr(lightPosition),
-                            "lightPosition");
-  voxelizeShader.setUniform(uniformType::fv3, glm::value_ptr(lightColor),
-                            "lightColor");
-  voxelizeShader.setUniform(uniformType::mat4x4,
-                            glm::value_ptr(shadowMap.getLightSpaceMatrix()),
-                            "lightSpaceMatrix");
-  voxelizeShader.setUniform(uniformType::i1, &shadowMapUnit, "shadowMap");
+  setVoxelizeUniform(uniformType::i1, &shads, "hasShadows");
+  setVoxelizeUniform(uniformType::fv3, glm::value_ptr(lightPosition),
+                     "lightPosition");
+  setVoxelizeUniform(uniformType::fv3, glm::value_ptr(lightColor),
+                     "lightColor");
+  setVoxelizeUniform(uniformType::mat4x4,
+                     glm::value_ptr(shadowMap.getLightSpaceMatrix()),
+                     "lightSpaceMatrix");
+  setVoxelizeUniform(uniformType::i1, &shadowMapUnit, "shadowMap");
 
   glActiveTexture(GL_TEXTURE1);
   glBindTexture(GL_TEXTURE_2D, shadowMap.getDepthMapTexture());
+}
 
-  glViewport(0, 0, VOXEL_DIM, VOXEL_DIM);
+// Sets a uniform of the voxelization shader, and of the compute shader that
+// voxelizes the small triangles when it is used.
+void VoxelMap::setVoxelizeUniform(uniformType type, void *param, char *name) {
+  if (hybridVoxelize) {
+    triangleVoxelizeShader.use();
+    triangleVoxelizeShader.setUniform(type, param, name);
+  }
+  voxelizeShader().use();
+  voxelizeShader().setUniform(type, param, name);
+}
 
-  scene.draw(voxelizeShader, 2);
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-  glActiveTexture(GL_TEXTURE0);
-  glGenerateMipmap(GL_TEXTURE_3D);
+// Sets the box that is mapped onto the voxel grid, made of voxels of the given
+// size. Only voxels inside [regionMin, regionMax) are written, at
+// (voxel + voxelOffset) modulo the grid size.
+void VoxelMap::setVoxelizeVolume(glm::vec3 worldCenter, glm::vec3 worldSizeHalf,
+                                 float voxelSize, glm::ivec3 regionMin,
+                                 glm::ivec3 regionMax, glm::ivec3 voxelOffset) {
+  voxelizeVoxelSize = voxelSize;
+  setVoxelizeUniform(uniformType::fv3, glm::value_ptr(worldCenter),
+                     "worldCenter");
+  setVoxelizeUniform(uniformType::fv3, glm::value_ptr(worldSizeHalf),
+                     "worldSizeHalf");
+  setVoxelizeUniform(uniformType::iv3, glm::value_ptr(regionMin), "regionMin");
+  setVoxelizeUniform(uniformType::iv3, glm::value_ptr(regionMax), "regionMax");
+  setVoxelizeUniform(uniformType::iv3, glm::value_ptr(voxelOffset),
+                     "voxelOffset");
+}
+
+// Triangles smaller than a voxel rasterize to about one fragment each, the
+// hybrid voxelizer hands them to a compute shader instead.
+void VoxelMap::drawVoxelize(glm::vec3 boundsMin, glm::vec3 boundsMax,
+                            MeshSet meshSet) {
+  float minTriangleSize = hybridVoxelize ? voxelizeVoxelSize : 0.0f;
+  scene.draw(voxelizeShader(), 2, boundsMin, boundsMax, meshSet,
+             isAxisBinned(), minTriangleSize);
+  if (hybridVoxelize) {
+    scene.dispatchTriangles(triangleVoxelizeShader, 2, boundsMin, boundsMax,
+                            meshSet, minTriangleSize);
+  }
+}
+
+// Voxelizes the meshes of a set that overlap a region of the bound volumes,
+// see setVoxelizeVolume. Averaged fragments are summed into the accumulation
+// volume, which only holds ACCUMULATION_DEPTH slices, so the region is then
+// drawn slab by slab and each slab resolved into the texture and the normal
+// texture, if it is not 0.
+void VoxelMap::drawVoxelizeRegion(glm::vec3 worldCenter,
+                                  glm::vec3 worldSizeHalf, float voxelSize,
+                                  glm::ivec3 regionMin, glm::ivec3 regionMax,
+                                  glm::ivec3 voxelOffset, MeshSet meshSet,
+                                  GLuint texture, GLuint normalTexture) {
+  glm::vec3 boxMin = worldCenter - worldSizeHalf;
+  int slabDepth = regionMax.z - regionMin.z;
+  if (isAveraging()) {
+    slabDepth = ACCUMULATION_DEPTH;
+    initAccumulation(glm::ivec2(regionMax - regionMin));
+    glBindImageTexture(6, accumulationTexture, 0, GL_TRUE, 0, GL_READ_WRITE,
+                       GL_R32UI);
+  }
+
+  for (int z = regionMin.z; z < regionMax.z; z += slabDepth) {
+    glm::ivec3 slabMin(regionMin.x, regionMin.y, z);
+    glm::ivec3 slabMax(regionMax.x, regionMax.y,
+                       std::min(z + slabDepth, regionMax.z));
+    setVoxelizeVolume(worldCenter, worldSizeHalf, voxelSize, slabMin, slabMax,
+                      voxelOffset);
+    // Meshes outside of the slab cannot write any of its voxels.
+    drawVoxelize(boxMin + glm::vec3(slabMin) * voxelSize,
+                 boxMin + glm::vec3(slabMax) * voxelSize, meshSet);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_TEXTURE_FETCH_BARRIER_BIT);
+    if (isAveraging())
+      resolveRegion(texture, normalTexture, slabMin, slabMax, voxelOffset);
+  }
+}
+
+// Makes the accumulation volume cover at least size voxels along x and y, with
+// the sums cleared.
+void VoxelMap::initAccumulation(glm::ivec2 size) {
+  if (accumulationTexture != 0 && size.x <= accumulationDim.x &&
+      size.y <= accumulationDim.y) {
+    return;
+  }
+  releaseAccumulation();
+  accumulationDim.x = std::max(size.x, accumulationDim.x);
+  accumulationDim.y = std::max(size.y, accumulationDim.y);
+  glGenTextures(1, &accumulationTexture);
+  glBindTexture(GL_TEXTURE_3D, accumulationTexture);
+  glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32UI, accumulationDim.x,
+                 accumulationDim.y, ACCUMULATION_CHANNELS * ACCUMULATION_DEPTH);
+  glBindTexture(GL_TEXTURE_3D, 0);
+  GLuint zero = 0;
+  glClearTexImage(accumulationTexture, 0, GL_RED_INTEGER, GL_UNSIGNED_INT,
+                  &zero);
+}
+
+void VoxelMap::releaseAccumulation() {
+  if (accumulationTexture == 0)
+    return;
+  glDeleteTextures(1, &accumulationTexture);
+  accumulationTexture = 0;
+}
+
+void VoxelMap::setAverageVoxels(bool _averageVoxels) {
+  averageVoxels = _averageVoxels;
+  if (!averageVoxels)
+    releaseAccumulation();
+}
+
+// Sets the square viewport the triangles are projected onto, one pixel per
+// voxel.
+void VoxelMap::setVoxelizeViewport(int size) {
+  glViewport(0, 0, size, size);
+  if (isAxisBinned())
+    return;
+  int conservativeVoxelize = conservative;
+  geometryVoxelizeShader.use();
+  geometryVoxelizeShader.setUniform(uniformType::i1, &conservativeVoxelize,
+                                    "conservative");
+  geometryVoxelizeShader.setUniform(uniformType::i1, &size, "viewportDim");
+}
 
+// Resets the octree fragment list for both voxelization shaders.
+void VoxelMap::beginFragmentList() {
+  if (hybridVoxelize) {
+    triangleVoxelizeShader.use();
+    octree.beginFragmentList(triangleVoxelizeShader);
+  }
+  voxelizeShader().use();
+  octree.beginFragmentList(voxelizeShader());
+}
+
+void VoxelMap::endVoxelize() {
   glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 
   glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
@@ -84,26 +1061,970 @@ void VoxelMap::voxelize(glm::vec3 lightPosition, glm::vec3 lightColor,
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
 
+void VoxelMap::voxelize(glm::vec3 lightPosition, glm::vec3 lightColor,
+                        int hasShadows) {
+  if (useProxy())
+    rebuildProxy(lightPosition, lightColor, hasShadows);
+  if (backend == VoxelBackend::DENSE && doubleBuffered && frontValid) {
+    queueRebuild(staticBaked ? RebuildStage::LIGHT : RebuildStage::STATIC,
+                 lightPosition, lightColor, hasShadows);
+    staticBaked = false;
+    return;
+  }
+
+  glm::vec3 worldCenter = scene.getWorldCenter();
+  float worldSizeHalf = 0.5f * scene.getWorldSize();
+
+  glBeginQuery(GL_TIME_ELAPSED, voxelizeQuery);
+  beginVoxelize(lightPosition, lightColor, hasShadows);
+
+  if (backend == VoxelBackend::OCTREE) {
+    // Collect the voxel fragments, rasterizing a second time if the fragment
+    // list had to grow, then build the octree from them.
+    setVoxelizeVolume(worldCenter, glm::vec3(worldSizeHalf),
+                      2.0f * worldSizeHalf / octree.getDim(), glm::ivec3(0),
+                      glm::ivec3(octree.getDim()), glm::ivec3(0));
+    setVoxelizeViewport(octree.getDim());
+    beginFragmentList();
+    drawVoxelize(glm::vec3(-FLT_MAX), glm::vec3(FLT_MAX), MeshSet::ALL);
+    if (octree.endFragmentList()) {
+      beginFragmentList();
+      drawVoxelize(glm::vec3(-FLT_MAX), glm::vec3(FLT_MAX), MeshSet::ALL);
+      octree.endFragmentList();
+    }
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    octreeFull = !octree.build();
+  } else if (backend == VoxelBackend::CLIPMAP) {
+    for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+      glm::ivec3 origin = getClipmapOrigin(level, clipmapCenter);
+      clipmapOrigins[level] = origin;
+      voxelizeClipmapRegion(level, origin, origin + CLIPMAP_DIM);
+    }
+  } else {
+    // The static meshes only store their surface, the light is injected into
+    // it afterwards. The dynamic meshes are lit as they are voxelized.
+    // Nothing is traced before the first voxelization, so it is done in the
+    // front volume right away.
+    if (!staticBaked)
+      voxelizeStatic(glm::ivec3(0), gridDim);
+    staticBaked = false;
+    lightRegion(front(), lightPosition, lightColor, hasShadows, glm::ivec3(0),
+                gridDim);
+    updateMipmaps(front(), glm::ivec3(0), gridDim);
+    frontValid = true;
+    bounceSlice = 0;
+    updateOccupancy();
+    irradianceValid = false;
+  }
+
+  endVoxelize();
+  glEndQuery(GL_TIME_ELAPSED);
+  // A full voxelization is rare, waiting for the result is fine.
+  GLuint64 elapsed;
+  glGetQueryObjectui64v(voxelizeQuery, GL_QUERY_RESULT, &elapsed);
+  voxelizeTime = elapsed / 1.0e6f;
+
+  // A scene the largest octree pools cannot hold falls back to the dense
+  // grid rather than being traced with holes.
+  if (backend == VoxelBackend::OCTREE && octreeFull) {
+    setBackend(VoxelBackend::DENSE);
+    octreeFull = true;
+    voxelize(lightPosition, lightColor, hasShadows);
+  }
+}
+
+// Relights the voxels after the light changed. The dense grid keeps the
+// surface of the static meshes and only reruns the light injection.
+void VoxelMap::relight(glm::vec3 lightPosition, glm::vec3 lightColor,
+                       int hasShadows) {
+  if (backend != VoxelBackend::DENSE) {
+    voxelize(lightPosition, lightColor, hasShadows);
+    return;
+  }
+  if (useProxy())
+    rebuildProxy(lightPosition, lightColor, hasShadows);
+  if (doubleBuffered && frontValid) {
+    queueRebuild(RebuildStage::LIGHT, lightPosition, lightColor, hasShadows);
+    return;
+  }
+
+  beginVoxelize(lightPosition, lightColor, hasShadows);
+  lightRegion(front(), lightPosition, lightColor, hasShadows, glm::ivec3(0),
+              gridDim);
+  updateMipmaps(front(), glm::ivec3(0), gridDim);
+  endVoxelize();
+  bounceSlice = 0;
+}
+
+// Revoxelizes only the voxels overlapping a world space box, e.g. the space
+// swept by a moving dynamic mesh, and the mip texels that depend on them. The
+// dense grid relights the static voxels of the box and only redraws the
+// dynamic meshes, or only relights the proxy that holds them.
+void VoxelMap::voxelizeRegion(glm::vec3 boundsMin, glm::vec3 boundsMax,
+                              glm::vec3 lightPosition, glm::vec3 lightColor,
+                              int hasShadows) {
+  // The octree is rebuilt from scratch.
+  if (backend == VoxelBackend::OCTREE) {
+    voxelize(lightPosition, lightColor, hasShadows);
+    return;
+  }
+
+  beginVoxelize(lightPosition, lightColor, hasShadows);
+
+  if (backend == VoxelBackend::CLIPMAP) {
+    for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+      float voxelSize = getClipmapVoxelSize(level);
+      glm::ivec3 origin = clipmapOrigins[level];
+      glm::ivec3 regionMin =
+          glm::max(glm::ivec3(glm::floor(boundsMin / voxelSize)) - 1, origin);
+      glm::ivec3 regionMax =
+          glm::min(glm::ivec3(glm::floor(boundsMax / voxelSize)) + 2,
+                   origin + CLIPMAP_DIM);
+      if (glm::any(glm::greaterThanEqual(regionMin, regionMax)))
+        continue;
+      voxelizeClipmapRegion(level, regionMin, regionMax);
+    }
+    endVoxelize();
+    return;
+  }
+
+  // The proxy moves with the rigid meshes, only its light changes. The static
+  // voxels in the region are still relit, since the shadow of the meshes on
+  // them moved.
+  if (useProxy())
+    lightProxy(lightPosition, lightColor, hasShadows);
+
+  glm::ivec3 regionMin, regionMax;
+  if (!getGridRegion(boundsMin, boundsMax, regionMin, regionMax)) {
+    if (useProxy())
+      updateOccupancy();
+    endVoxelize();
+    return;
+  }
+  if (deferRegion(regionMin, regionMax)) {
+    if (useProxy())
+      updateOccupancy();
+    endVoxelize();
+    return;
+  }
+
+  lightRegion(front(), lightPosition, lightColor, hasShadows, regionMin,
+              regionMax);
+  updateMipmaps(front(), regionMin, regionMax);
+  updateOccupancy();
+  endVoxelize();
+
+  markStale(regionMin, regionMax);
+}
+
+// Applies an edit of the parameters of a material. The dense grid keeps the
+// material ID of the static voxels and only relights the voxels of the
+// material, which gives the same voxels as voxelizing everything again. The
+// dynamic meshes are lit as they are voxelized, so they are revoxelized where
+// they are, also when the relit voxels overlap them.
+void VoxelMap::updateMaterial(size_t materialId, glm::vec3 lightPosition,
+                              glm::vec3 lightColor, int hasShadows) {
+  glm::vec3 boundsMin, boundsMax;
+  if (backend != VoxelBackend::DENSE) {
+    if (scene.getMaterialBounds(materialId, MeshSet::ALL, boundsMin,
+                                boundsMax)) {
+      voxelizeRegion(boundsMin, boundsMax, lightPosition, lightColor,
+                     hasShadows);
+    }
+    return;
+  }
+
+  glm::vec3 dynamicMin, dynamicMax;
+  scene.getDynamicBounds(scene.dynamicMeshPosition, dynamicMin, dynamicMax);
+  bool redrawDynamic = scene.getMaterialBounds(materialId, MeshSet::DYNAMIC,
+                                               boundsMin, boundsMax);
+  glm::ivec3 regionMin, regionMax;
+  if (scene.getMaterialBounds(materialId, MeshSet::STATIC, boundsMin,
+                              boundsMax) &&
+      getGridRegion(boundsMin, boundsMax, regionMin, regionMax) &&
+      !deferRegion(regionMin, regionMax)) {
+    setInjectionLight(lightPosition, lightColor, hasShadows);
+    injectLight(front().voxelTexture, getInternalFormat(),
+                front().opacityTexture, geometryTextures,
+                scene.getWorldCenter(), getGridSizeHalf(), regionMin,
+                regionMax, (int)materialId);
+    updateMipmaps(front(), regionMin, regionMax);
+
+    glm::ivec3 dynamicRegionMin, dynamicRegionMax;
+    if (!useProxy() && getGridRegion(dynamicMin, dynamicMax, dynamicRegionMin,
+                                     dynamicRegionMax)) {
+      redrawDynamic =
+          redrawDynamic ||
+          (glm::all(glm::lessThan(regionMin, dynamicRegionMax)) &&
+           glm::all(glm::lessThan(dynamicRegionMin, regionMax)));
+    }
+
+    markStale(regionMin, regionMax);
+  }
+
+  if (redrawDynamic)
+    voxelizeRegion(dynamicMin, dynamicMax, lightPosition, lightColor,
+                   hasShadows);
+}
+
+// The grid voxels overlapping a world space box, grown by a voxel so that
+// partially covered voxels are included. Returns false if there are none.
+bool VoxelMap::getGridRegion(glm::vec3 boundsMin, glm::vec3 boundsMax,
+                             glm::ivec3 &regionMin, glm::ivec3 &regionMax) {
+  glm::vec3 gridMin = scene.getWorldCenter() - getGridSizeHalf();
+  float voxelSize = getGridVoxelSize();
+  regionMin = glm::max(
+      glm::ivec3(glm::floor((boundsMin - gridMin) / voxelSize)) - 1,
+      glm::ivec3(0));
+  regionMax = glm::min(
+      glm::ivec3(glm::floor((boundsMax - gridMin) / voxelSize)) + 2, gridDim);
+  return glm::all(glm::lessThan(regionMin, regionMax));
+}
+
+// Lights the next slices of the back volume with the bounce gathered from the
+// front volume on top of the direct light, and updates their mips. The
+// volumes are swapped once the sweep reaches the end of the grid, so the
+// bounce never gathers from the voxels it writes and every sweep adds one.
+// Rebuilds of the back volume start over from the direct light once they
+// are swapped in.
+void VoxelMap::propagateLight(glm::vec3 lightPosition, glm::vec3 lightColor,
+                              int hasShadows) {
+  if (!multiBounce || backend != VoxelBackend::DENSE || !frontValid ||
+      isRebuilding())
+    return;
+  if (bounceSlice == 0) {
+    staleMin = gridDim;
+    staleMax = glm::ivec3(0);
+  }
+  glm::ivec3 regionMin(0, 0, bounceSlice);
+  glm::ivec3 regionMax = gridDim;
+  regionMax.z = std::min(bounceSlice + bounceSlices, gridDim.z);
+  bounceSlice = regionMax.z % gridDim.z;
+
+  beginVoxelize(lightPosition, lightColor, hasShadows);
+  setInjectionBounce(&front());
+  lightRegion(back(), lightPosition, lightColor, hasShadows, regionMin,
+              regionMax);
+  setInjectionBounce(NULL);
+  updateMipmaps(back(), regionMin, regionMax);
+  endVoxelize();
+
+  if (bounceSlice == 0)
+    swapBounce(lightPosition, lightColor, hasShadows);
+}
+
+// Makes the volume of the finished sweep the traced one. The region updates
+// it missed are lit again with the bounce of the volume it replaces.
+void VoxelMap::swapBounce(glm::vec3 lightPosition, glm::vec3 lightColor,
+                          int hasShadows) {
+  frontVolume = 1 - frontVolume;
+  releaseViews();
+  initViews();
+
+  if (glm::all(glm::lessThan(staleMin, staleMax))) {
+    beginVoxelize(lightPosition, lightColor, hasShadows);
+    setInjectionBounce(&back());
+    lightRegion(front(), lightPosition, lightColor, hasShadows, staleMin,
+                staleMax);
+    setInjectionBounce(NULL);
+    updateMipmaps(front(), staleMin, staleMax);
+    endVoxelize();
+  }
+  updateOccupancy();
+}
+
+// Region updates only change the front volume. A rebuild or a bounce sweep
+// may already have lit the region in the back volume, it is lit again after
+// the swap.
+void VoxelMap::markStale(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+  if (!isRebuilding() && bounceSlice == 0)
+    return;
+  staleMin = glm::min(staleMin, regionMin);
+  staleMax = glm::max(staleMax, regionMax);
+}
+
+// Starts rebuilding the back volume from the given stage. An edit whose stage
+// has already run, or is running, restarts the rebuild from it instead of
+// queueing another one, so repeated edits coalesce.
+void VoxelMap::queueRebuild(RebuildStage stage, glm::vec3 lightPosition,
+                            glm::vec3 lightColor, int hasShadows) {
+  rebuildLightPosition = lightPosition;
+  rebuildLightColor = lightColor;
+  rebuildHasShadows = hasShadows;
+  if (isRebuilding() && stage > rebuildStage)
+    return;
+
+  if (!isRebuilding()) {
+    staleMin = gridDim;
+    staleMax = glm::ivec3(0);
+    rebuildTime = 0.0f;
+    bounceSlice = 0;
+  }
+  if (rebuildFence != 0) {
+    glDeleteSync(rebuildFence);
+    rebuildFence = 0;
+  }
+  rebuildStage = stage;
+  rebuildSlab = 0;
+}
+
+void VoxelMap::cancelRebuild() {
+  if (rebuildFence != 0)
+    glDeleteSync(rebuildFence);
+  rebuildFence = 0;
+  rebuildStage = RebuildStage::IDLE;
+}
+
+// Fraction of the slabs of the current rebuild that are done.
+float VoxelMap::getRebuildProgress() {
+  if (!isRebuilding())
+    return 1.0f;
+  if (rebuildStage == RebuildStage::FENCE)
+    return 1.0f;
+  return ((int)rebuildStage + (float)rebuildSlab / gridDim.z) / 3.0f;
+}
+
+// Continues the rebuild of the back volume, called once a frame. After the
+// last stage the volumes are swapped as soon as the fence is signaled,
+// without waiting for it.
+void VoxelMap::advanceRebuild() {
+  if (!isRebuilding())
+    return;
+  collectRebuildTimes(false);
+
+  if (rebuildStage == RebuildStage::FENCE) {
+    GLenum status =
+        glClientWaitSync(rebuildFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+      swapVolumes();
+    return;
+  }
+
+  runRebuildSlabs();
+  if (rebuildSlab < gridDim.z)
+    return;
+  rebuildStage = (RebuildStage)((int)rebuildStage + 1);
+  rebuildSlab = 0;
+  if (rebuildStage == RebuildStage::FENCE)
+    rebuildFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Runs as many slabs of the current stage as the budget allows, at least one
+// so the rebuild always progresses.
+void VoxelMap::runRebuildSlabs() {
+  int stage = (int)rebuildStage;
+  int depth = getSlabDepth(rebuildStage);
+  int slabs = (gridDim.z - rebuildSlab + depth - 1) / depth;
+  if (rebuildBudget > 0.0f) {
+    int fitting =
+        slabTimes[stage] > 0.0f ? (int)(rebuildBudget / slabTimes[stage]) : 1;
+    slabs = glm::clamp(fitting, 1, slabs);
+  }
+
+  // The oldest query is only still pending if the GPU is frames behind.
+  RebuildQuery &query = rebuildQueries[nextRebuildQuery];
+  nextRebuildQuery = (nextRebuildQuery + 1) % REBUILD_QUERIES;
+  if (query.pending)
+    collectRebuildTimes(true);
+  query.stage = stage;
+  query.slabs = slabs;
+  query.pending = true;
+
+  glBeginQuery(GL_TIME_ELAPSED, query.query);
+  beginVoxelize(rebuildLightPosition, rebuildLightColor, rebuildHasShadows);
+  for (int i = 0; i < slabs; i++) {
+    glm::ivec3 regionMin(0, 0, rebuildSlab);
+    glm::ivec3 regionMax(gridDim.x, gridDim.y,
+                         std::min(rebuildSlab + depth, gridDim.z));
+    if (rebuildStage == RebuildStage::STATIC) {
+      voxelizeStatic(regionMin, regionMax);
+    } else if (rebuildStage == RebuildStage::LIGHT) {
+      lightRegion(back(), rebuildLightPosition, rebuildLightColor,
+                  rebuildHasShadows, regionMin, regionMax);
+    } else {
+      updateMipmaps(back(), regionMin, regionMax);
+    }
+    rebuildSlab = regionMax.z;
+  }
+  endVoxelize();
+  glEndQuery(GL_TIME_ELAPSED);
+}
+
+// Reads the timer queries of finished rebuild work into the slab estimates,
+// waiting for them only if asked to.
+void VoxelMap::collectRebuildTimes(bool wait) {
+  for (int i = 0; i < REBUILD_QUERIES; i++) {
+    RebuildQuery &query = rebuildQueries[i];
+    if (!query.pending)
+      continue;
+    if (!wait) {
+      GLuint available;
+      glGetQueryObjectuiv(query.query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        continue;
+    }
+    GLuint64 elapsed;
+    glGetQueryObjectui64v(query.query, GL_QUERY_RESULT, &elapsed);
+    query.pending = false;
+    float ms = elapsed / 1.0e6f;
+    rebuildTime += ms;
+    slabTimes[query.stage] = ms / query.slabs;
+  }
+}
+
+// Region updates of the front read the geometry volumes, which the static
+// stage of a rebuild rewrites slab by slab. They wait for the swap instead,
+// which relights the stale region from the finished geometry.
+bool VoxelMap::deferRegion(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+  if (rebuildStage != RebuildStage::STATIC)
+    return false;
+  staleMin = glm::min(staleMin, regionMin);
+  staleMax = glm::max(staleMax, regionMax);
+  return true;
+}
+
+// Makes the rebuilt back volume the traced one and replays the region
+// updates it missed.
+void VoxelMap::swapVolumes() {
+  glDeleteSync(rebuildFence);
+  rebuildFence = 0;
+  rebuildStage = RebuildStage::IDLE;
+  frontVolume = 1 - frontVolume;
+  releaseViews();
+  initViews();
+
+  if (glm::all(glm::lessThan(staleMin, staleMax))) {
+    beginVoxelize(rebuildLightPosition, rebuildLightColor, rebuildHasShadows);
+    lightRegion(front(), rebuildLightPosition, rebuildLightColor,
+                rebuildHasShadows, staleMin, staleMax);
+    updateMipmaps(front(), staleMin, staleMax);
+    endVoxelize();
+  }
+  updateOccupancy();
+
+  // The fence passed, so all the queries of the rebuild are done.
+  collectRebuildTimes(true);
+  voxelizeTime = rebuildTime;
+}
+
+// Voxelizes the albedo, normal and material ID of the static meshes into
+// a region of the geometry volumes.
+void VoxelMap::voxelizeStatic(glm::ivec3 regionMin, glm::ivec3 regionMax) {
+  int voxelTarget = 2;
+  int viewportSize = glm::max(gridDim.x, glm::max(gridDim.y, gridDim.z));
+
+  clear(regionMin, regionMax);
+  for (int i = 0; i < 3; i++) {
+    glBindImageTexture(1 + i, geometryTextures[i], 0, GL_TRUE, 0,
+                       GL_READ_WRITE, GL_R32UI);
+  }
+  setVoxelizeUniform(uniformType::i1, &voxelTarget, "voxelTarget");
+  setVoxelizeViewport(viewportSize);
+  drawVoxelizeRegion(scene.getWorldCenter(), getGridSizeHalf(),
+                     getGridVoxelSize(), regionMin, regionMax, glm::ivec3(0),
+                     MeshSet::STATIC, geometryTextures[0], geometryTextures[1]);
+
+  voxelTarget = 0;
+  setVoxelizeUniform(uniformType::i1, &voxelTarget, "voxelTarget");
+}
+
+// Voxelizes the albedo, normal and material ID of the dynamic meshes into
+// the geometry volumes of the proxy. Its box moves with the meshes, so the
+// voxels stay the same wherever they are.
+void VoxelMap::voxelizeProxy() {
+  int voxelTarget = 2;
+  glm::vec3 sizeHalf = glm::vec3(0.5f * proxyDim * proxyVoxelSize);
+  glm::vec3 center = proxyLocalMin + scene.dynamicMeshPosition + sizeHalf;
+
+  GLuint clearColor = 0;
+  for (int i = 0; i < 3; i++) {
+    glClearTexImage(proxyGeometryTextures[i], 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                    &clearColor);
+    glBindImageTexture(1 + i, proxyGeometryTextures[i], 0, GL_TRUE, 0,
+                       GL_READ_WRITE, GL_R32UI);
+  }
+  setVoxelizeUniform(uniformType::i1, &voxelTarget, "voxelTarget");
+  setVoxelizeViewport(proxyDim);
+  drawVoxelizeRegion(center, sizeHalf, proxyVoxelSize, glm::ivec3(0),
+                     glm::ivec3(proxyDim), glm::ivec3(0), MeshSet::DYNAMIC,
+                     proxyGeometryTextures[0], proxyGeometryTextures[1]);
+
+  voxelTarget = 0;
+  setVoxelizeUniform(uniformType::i1, &voxelTarget, "voxelTarget");
+}
+
+// The proxy is small, it is rebuilt right away even when the dense grid is
+// rebuilt over several frames. Material edits of the dynamic meshes only
+// relight, so relights voxelize it again too.
+void VoxelMap::rebuildProxy(glm::vec3 lightPosition, glm::vec3 lightColor,
+                            int hasShadows) {
+  beginVoxelize(lightPosition, lightColor, hasShadows);
+  voxelizeProxy();
+  lightProxy(lightPosition, lightColor, hasShadows);
+  endVoxelize();
+}
+
+// Lights the proxy where the dynamic meshes are now and rebuilds its mips.
+void VoxelMap::lightProxy(glm::vec3 lightPosition, glm::vec3 lightColor,
+                          int hasShadows) {
+  glm::vec3 sizeHalf = glm::vec3(0.5f * proxyDim * proxyVoxelSize);
+  glm::vec3 center = proxyLocalMin + scene.dynamicMeshPosition + sizeHalf;
+  setInjectionLight(lightPosition, lightColor, hasShadows);
+  injectLight(proxyTexture, GL_RGBA8, 0, proxyGeometryTextures, center,
+              sizeHalf, glm::ivec3(0), glm::ivec3(proxyDim), -1);
+  updateProxyMipmaps();
+}
+
+// Rebuilds the mips of the proxy with the current filter.
+void VoxelMap::updateProxyMipmaps() {
+  GLuint sourceUnit = 0;
+  int filter = (int)mipmapFilter;
+  int separateOpacity = 0;
+  mipmapShader.use();
+  mipmapShader.setUniform(uniformType::i1, &sourceUnit, "source");
+  mipmapShader.setUniform(uniformType::i1, &filter, "mipmapFilter");
+  mipmapShader.setUniform(uniformType::i1, &separateOpacity,
+                          "separateOpacity");
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_3D, proxyTexture);
+  for (int level = 1; (proxyDim >> level) > 0; level++) {
+    int sourceLevel = level - 1;
+    glm::ivec3 levelMin = glm::ivec3(0);
+    glm::ivec3 levelMax = glm::ivec3(proxyDim >> level);
+    glm::ivec3 groups = (levelMax + 3) / 4;
+    glBindImageTexture(0, proxyTexture, level, GL_TRUE, 0, GL_WRITE_ONLY,
+                       GL_RGBA8);
+    mipmapShader.setUniform(uniformType::i1, &sourceLevel, "sourceLevel");
+    mipmapShader.setUniform(uniformType::iv3, glm::value_ptr(levelMin),
+                            "regionMin");
+    mipmapShader.setUniform(uniformType::iv3, glm::value_ptr(levelMax),
+                            "regionMax");
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_TEXTURE_FETCH_BARRIER_BIT);
+  }
+}
+
+// Sets the light the injection shader lights the voxels with.
+void VoxelMap::setInjectionLight(glm::vec3 lightPosition, glm::vec3 lightColor,
+                                 int hasShadows) {
+  GLuint shadowMapUnit = 1;
+  injectionShader.use();
+  injectionShader.setUniform(uniformType::fv3, glm::value_ptr(lightPosition),
+                             "lightPosition");
+  injectionShader.setUniform(uniformType::fv3, glm::value_ptr(lightColor),
+                             "lightColor");
+  injectionShader.setUniform(uniformType::mat4x4,
+                             glm::value_ptr(shadowMap.getLightSpaceMatrix()),
+                             "lightSpaceMatrix");
+  injectionShader.setUniform(uniformType::i1, &hasShadows, "hasShadows");
+  injectionShader.setUniform(uniformType::i1, &shadowMapUnit, "shadowMap");
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, shadowMap.getDepthMapTexture());
+
+  // Material edits change the emissive colors between injections.
+  std::vector<glm::vec4> emissive(scene.getMaterialCount());
+  for (size_t i = 0; i < emissive.size(); i++)
+    emissive[i] = glm::vec4(scene.getMaterial(i).ke, 0.0f);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * emissive.size(),
+               &emissive[0], GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Makes the light injection add the light the voxels gather from a lit
+// volume and the proxy, or stop adding it if there is none.
+void VoxelMap::setInjectionBounce(DenseVolume *source) {
+  int bounce = source != NULL;
+  injectionShader.use();
+  injectionShader.setUniform(uniformType::i1, &bounce, "bounce");
+  if (!bounce)
+    return;
+
+  GLuint litUnit = 2;
+  GLuint opacityUnit = 3;
+  GLuint directionalUnit = 4;
+  int filter = (int)mipmapFilter;
+  int anisotropicVoxels = anisotropic;
+  float voxelSize = getGridVoxelSize();
+  injectionShader.setUniform(uniformType::f1, &voxelSize, "voxelSize");
+  injectionShader.setUniform(uniformType::i1, &filter, "mipmapFilter");
+  injectionShader.setUniform(uniformType::i1, &anisotropicVoxels,
+                             "anisotropicVoxels");
+  injectionShader.setUniform(uniformType::i1, &litUnit, "litVolume");
+  injectionShader.setUniform(uniformType::i1, &opacityUnit, "litOpacity");
+  injectionShader.setUniform(uniformType::i1, &directionalUnit,
+                             "litDirectional");
+  glActiveTexture(GL_TEXTURE0 + litUnit);
+  glBindTexture(GL_TEXTURE_3D, source->voxelTexture);
+  glActiveTexture(GL_TEXTURE0 + opacityUnit);
+  glBindTexture(GL_TEXTURE_3D, source->opacityTexture);
+  glActiveTexture(GL_TEXTURE0 + directionalUnit);
+  glBindTexture(GL_TEXTURE_3D, source->directionalTexture);
+  bindProxy(injectionShader, 5, voxelSize);
+}
+
+// Lights the voxels of a region of a volume from the albedo, normal and
+// material geometry volumes of the same size, or only the voxels of the given
+// material if it is not -1. The volume spans the given box in world space.
+void VoxelMap::injectLight(GLuint texture, GLenum format, GLuint opacity,
+                           GLuint *geometry, glm::vec3 worldCenter,
+                           glm::vec3 worldSizeHalf, glm::ivec3 regionMin,
+                           glm::ivec3 regionMax, int material) {
+  injectionShader.use();
+  injectionShader.setUniform(uniformType::fv3, glm::value_ptr(worldCenter),
+                             "worldCenter");
+  injectionShader.setUniform(uniformType::fv3, glm::value_ptr(worldSizeHalf),
+                             "worldSizeHalf");
+  injectionShader.setUniform(uniformType::iv3, glm::value_ptr(regionMin),
+                             "regionMin");
+  injectionShader.setUniform(uniformType::iv3, glm::value_ptr(regionMax),
+                             "regionMax");
+  injectionShader.setUniform(uniformType::i1, &material, "materialFilter");
+  int separateOpacity = opacity != 0;
+  injectionShader.setUniform(uniformType::i1, &separateOpacity,
+                             "separateOpacity");
+  glBindImageTexture(0, texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, format);
+  if (separateOpacity)
+    glBindImageTexture(4, opacity, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R8);
+  for (int i = 0; i < 2; i++) {
+    glBindImageTexture(1 + i, geometry[i], 0, GL_TRUE, 0, GL_READ_ONLY,
+                       GL_RGBA8);
+  }
+  glBindImageTexture(3, geometry[2], 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32UI);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, materialBuffer);
+  glm::ivec3 groups = (regionMax - regionMin + 3) / 4;
+  glDispatchCompute(groups.x, groups.y, groups.z);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                  GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Injects the light into the static voxels of a region of a lit volume and
+// voxelizes the dynamic meshes on top of them, unless they are kept in the
+// proxy.
+void VoxelMap::lightRegion(DenseVolume &volume, glm::vec3 lightPosition,
+                           glm::vec3 lightColor, int hasShadows,
+                           glm::ivec3 regionMin, glm::ivec3 regionMax) {
+  glm::vec3 worldCenter = scene.getWorldCenter();
+  glm::vec3 worldSizeHalf = getGridSizeHalf();
+  int separateOpacity = hasSeparateOpacity();
+
+  setInjectionLight(lightPosition, lightColor, hasShadows);
+  injectLight(volume.voxelTexture, getInternalFormat(), volume.opacityTexture,
+              geometryTextures, worldCenter, worldSizeHalf, regionMin,
+              regionMax, -1);
+  if (useProxy())
+    return;
+
+  int viewportSize = glm::max(gridDim.x, glm::max(gridDim.y, gridDim.z));
+  voxelizeShader().use();
+  if (voxelFormat == VoxelFormat::RGBA8) {
+    glBindImageTexture(0, volume.voxelTexture, 0, GL_TRUE, 0, GL_READ_WRITE,
+                       GL_R32UI);
+  } else {
+    glBindImageTexture(4, volume.voxelTexture, 0, GL_TRUE, 0, GL_WRITE_ONLY,
+                       getInternalFormat());
+  }
+  if (separateOpacity) {
+    glBindImageTexture(5, volume.opacityTexture, 0, GL_TRUE, 0,
+                       GL_WRITE_ONLY, GL_R8);
+  }
+  setVoxelizeViewport(viewportSize);
+  drawVoxelizeRegion(worldCenter, worldSizeHalf, getGridVoxelSize(), regionMin,
+                     regionMax, glm::ivec3(0), MeshSet::DYNAMIC,
+                     volume.voxelTexture, 0);
+}
+
+// Averages the fragments summed into the accumulation volume by averaged voxel
+// writes into a region of the texture, and of the normal texture if it is not
+// 0. The region may wrap around the edges of the textures.
+void VoxelMap::resolveRegion(GLuint texture, GLuint normalTexture,
+                             glm::ivec3 regionMin, glm::ivec3 regionMax,
+                             glm::ivec3 voxelOffset) {
+  int hasNormals = normalTexture != 0;
+  int accumulationDepth = ACCUMULATION_DEPTH;
+  resolveShader.use();
+  resolveShader.setUniform(uniformType::iv3, glm::value_ptr(regionMin),
+                           "regionMin");
+  resolveShader.setUniform(uniformType::iv3, glm::value_ptr(regionMax),
+                           "regionMax");
+  resolveShader.setUniform(uniformType::iv3, glm::value_ptr(voxelOffset),
+                           "voxelOffset");
+  resolveShader.setUniform(uniformType::i1, &hasNormals, "hasNormals");
+  resolveShader.setUniform(uniformType::i1, &accumulationDepth,
+                           "accumulationDepth");
+  glBindImageTexture(0, texture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32UI);
+  if (hasNormals) {
+    glBindImageTexture(1, normalTexture, 0, GL_TRUE, 0, GL_READ_WRITE,
+                       GL_R32UI);
+  }
+  glBindImageTexture(2, accumulationTexture, 0, GL_TRUE, 0, GL_READ_WRITE,
+                     GL_R32UI);
+  glm::ivec3 groups = (regionMax - regionMin + 3) / 4;
+  glDispatchCompute(groups.x, groups.y, groups.z);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                  GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Rebuilds the mips of the traced volume and of the proxy, e.g. after the
+// filter changed. A rebuild in progress redoes its own.
+void VoxelMap::updateMipmaps() {
+  if (backend != VoxelBackend::DENSE)
+    return;
+  updateMipmaps(front(), glm::ivec3(0), gridDim);
+  if (useProxy())
+    updateProxyMipmaps();
+  // The slices of a bounce sweep have mips of the previous filter.
+  bounceSlice = 0;
+  if (isRebuilding()) {
+    queueRebuild(RebuildStage::MIPMAPS, rebuildLightPosition,
+                 rebuildLightColor, rebuildHasShadows);
+  }
+}
+
+// Rebuilds the mip texels of a lit volume whose footprint overlaps the given
+// region of the base level, followed by the directional volumes.
+void VoxelMap::updateMipmaps(DenseVolume &volume, glm::ivec3 regionMin,
+                             glm::ivec3 regionMax) {
+  updateMipLevels(volume.voxelTexture, getInternalFormat(),
+                  volume.opacityTexture, regionMin, regionMax);
+  if (anisotropic)
+    updateDirectionalRegion(volume, regionMin, regionMax);
+}
+
+// Rebuilds the mip texels of a texture whose footprint overlaps the given
+// region of the base level, one level at a time from the next finer level.
+// The opacity texture is 0 for formats with alpha.
+void VoxelMap::updateMipLevels(GLuint texture, GLenum format,
+                               GLuint opacityTexture, glm::ivec3 regionMin,
+                               glm::ivec3 regionMax) {
+  GLuint sourceUnit = 0;
+  GLuint opacitySourceUnit = 1;
+  int filter = (int)mipmapFilter;
+  int separateOpacity = opacityTexture != 0;
+  mipmapShader.use();
+  mipmapShader.setUniform(uniformType::i1, &sourceUnit, "source");
+  mipmapShader.setUniform(uniformType::i1, &opacitySourceUnit,
+                          "opacitySource");
+  mipmapShader.setUniform(uniformType::i1, &filter, "mipmapFilter");
+  mipmapShader.setUniform(uniformType::i1, &separateOpacity,
+                          "separateOpacity");
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_3D, texture);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_3D, opacityTexture);
+
+  for (int level = 1; level < getMipLevels(); level++) {
+    int sourceLevel = level - 1;
+    glm::ivec3 levelMin = regionMin >> level;
+    glm::ivec3 levelMax = ((regionMax - 1) >> level) + 1;
+    glm::ivec3 groups = (levelMax - levelMin + 3) / 4;
+
+    glBindImageTexture(0, texture, level, GL_TRUE, 0, GL_WRITE_ONLY, format);
+    if (separateOpacity) {
+      glBindImageTexture(1, opacityTexture, level, GL_TRUE, 0, GL_WRITE_ONLY,
+                         GL_R8);
+    }
+    mipmapShader.setUniform(uniformType::i1, &sourceLevel, "sourceLevel");
+    mipmapShader.setUniform(uniformType::iv3, glm::value_ptr(levelMin),
+                            "regionMin");
+    mipmapShader.setUniform(uniformType::iv3, glm::value_ptr(levelMax),
+                            "regionMax");
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_TEXTURE_FETCH_BARRIER_BIT);
+  }
+}
+
+// Rebuilds the directional volumes of a lit volume over the given region of
+// the base level.
+// Level 0 composites the voxel texture front to back along each direction,
+// the coarser levels composite the previous level of the same direction.
+void VoxelMap::updateDirectionalRegion(DenseVolume &volume,
+                                       glm::ivec3 regionMin,
+                                       glm::ivec3 regionMax) {
+  GLuint voxelTextureUnit = 0;
+  GLuint directionalUnit = 1;
+  GLuint opacityUnit = 2;
+  int separateOpacity = hasSeparateOpacity();
+  anisotropicShader.use();
+  anisotropicShader.setUniform(uniformType::i1, &voxelTextureUnit,
+                               "voxelTexture");
+  anisotropicShader.setUniform(uniformType::i1, &directionalUnit,
+                               "directionalVoxels");
+  anisotropicShader.setUniform(uniformType::i1, &opacityUnit,
+                               "opacityTexture");
+  anisotropicShader.setUniform(uniformType::i1, &separateOpacity,
+                               "separateOpacity");
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_3D, volume.voxelTexture);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_3D, volume.directionalTexture);
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_3D, volume.opacityTexture);
+
+  for (int level = 0; level < getMipLevels() - 1; level++) {
+    glm::ivec3 levelMin = regionMin >> (level + 1);
+    glm::ivec3 levelMax = ((regionMax - 1) >> (level + 1)) + 1;
+    glm::ivec3 groups = (levelMax - levelMin + 3) / 4;
+
+    glBindImageTexture(0, volume.directionalTexture, level, GL_TRUE, 0,
+                       GL_WRITE_ONLY, getDirectionalFormat());
+    anisotropicShader.setUniform(uniformType::i1, &level, "level");
+    anisotropicShader.setUniform(uniformType::iv3, glm::value_ptr(levelMin),
+                                 "regionMin");
+    anisotropicShader.setUniform(uniformType::iv3, glm::value_ptr(levelMax),
+                                 "regionMax");
+    glDispatchCompute(groups.x, groups.y, groups.z);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                    GL_TEXTURE_FETCH_BARRIER_BIT);
+  }
+}
+
+// Origin of a clipmap level in voxels of that level. Snapping to even voxels
+// keeps every level aligned with the voxels of the next coarser level.
+glm::ivec3 VoxelMap::getClipmapOrigin(int level, glm::vec3 center) {
+  float voxelSize = getClipmapVoxelSize(level);
+  glm::ivec3 cell = 2 * glm::ivec3(glm::floor(center / (2.0f * voxelSize)));
+  return cell - CLIPMAP_DIM / 2;
+}
+
+// Clears the texels of a world space voxel region, which may wrap around
+// the edges of the toroidally addressed texture.
+void VoxelMap::clearClipmapRegion(int level, glm::ivec3 regionMin,
+                                  glm::ivec3 regionMax) {
+  int start[3][2], size[3][2], pieces[3];
+  for (int axis = 0; axis < 3; axis++) {
+    int first = ((regionMin[axis] % CLIPMAP_DIM) + CLIPMAP_DIM) % CLIPMAP_DIM;
+    int length = regionMax[axis] - regionMin[axis];
+    start[axis][0] = first;
+    size[axis][0] = std::min(length, CLIPMAP_DIM - first);
+    start[axis][1] = 0;
+    size[axis][1] = length - size[axis][0];
+    pieces[axis] = size[axis][1] > 0 ? 2 : 1;
+  }
+
+  GLuint clearColor = 0;
+  for (int i = 0; i < pieces[0]; i++) {
+    for (int j = 0; j < pieces[1]; j++) {
+      for (int k = 0; k < pieces[2]; k++) {
+        glClearTexSubImage(clipmapTextures[level], 0, start[0][i], start[1][j],
+                           start[2][k], size[0][i], size[1][j], size[2][k],
+                           GL_RGBA, GL_UNSIGNED_BYTE, &clearColor);
+      }
+    }
+  }
+}
+
+void VoxelMap::voxelizeClipmapRegion(int level, glm::ivec3 regionMin,
+                                     glm::ivec3 regionMax) {
+  clearClipmapRegion(level, regionMin, regionMax);
+
+  float voxelSize = getClipmapVoxelSize(level);
+  glm::ivec3 origin = clipmapOrigins[level];
+  glm::vec3 worldCenter = (glm::vec3(origin) + 0.5f * CLIPMAP_DIM) * voxelSize;
+  glm::vec3 worldSizeHalf = glm::vec3(0.5f * CLIPMAP_DIM * voxelSize);
+  glm::ivec3 voxelOffset;
+  for (int axis = 0; axis < 3; axis++) {
+    voxelOffset[axis] =
+        ((origin[axis] % CLIPMAP_DIM) + CLIPMAP_DIM) % CLIPMAP_DIM;
+  }
+
+  voxelizeShader().use();
+  glBindImageTexture(0, clipmapTextures[level], 0, GL_TRUE, 0, GL_READ_WRITE,
+                     GL_R32UI);
+  setVoxelizeViewport(CLIPMAP_DIM);
+  drawVoxelizeRegion(worldCenter, worldSizeHalf, voxelSize, regionMin - origin,
+                     regionMax - origin, voxelOffset, MeshSet::ALL,
+                     clipmapTextures[level], 0);
+}
+
+// Recenters the clipmap levels on the given position. Levels that moved
+// scroll toroidally and only the newly exposed slabs are revoxelized.
+void VoxelMap::updateClipmap(glm::vec3 center, glm::vec3 lightPosition,
+                             glm::vec3 lightColor, int hasShadows) {
+  clipmapCenter = center;
+  if (backend != VoxelBackend::CLIPMAP)
+    return;
+
+  bool voxelizing = false;
+  for (int level = 0; level < CLIPMAP_LEVELS; level++) {
+    glm::ivec3 origin = getClipmapOrigin(level, center);
+    glm::ivec3 oldOrigin = clipmapOrigins[level];
+    glm::ivec3 delta = origin - oldOrigin;
+    if (delta == glm::ivec3(0))
+      continue;
+
+    if (!voxelizing) {
+      beginVoxelize(lightPosition, lightColor, hasShadows);
+      voxelizing = true;
+    }
+    clipmapOrigins[level] = origin;
+
+    if (std::abs(delta.x) >= CLIPMAP_DIM || std::abs(delta.y) >= CLIPMAP_DIM ||
+        std::abs(delta.z) >= CLIPMAP_DIM) {
+      voxelizeClipmapRegion(level, origin, origin + CLIPMAP_DIM);
+      continue;
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+      if (delta[axis] == 0)
+        continue;
+      glm::ivec3 regionMin = origin;
+      glm::ivec3 regionMax = origin + CLIPMAP_DIM;
+      if (delta[axis] > 0) {
+        regionMin[axis] = oldOrigin[axis] + CLIPMAP_DIM;
+      } else {
+        regionMax[axis] = oldOrigin[axis];
+      }
+      voxelizeClipmapRegion(level, regionMin, regionMax);
+    }
+  }
+
+  if (voxelizing)
+    endVoxelize();
+}
+
 void VoxelMap::render(Camera &camera, glm::vec3 lightPosition,
                       glm::vec3 lightColor, int diffuseGI, int specularGI) {
   glm::mat4 modelT = glm::mat4(1.0f);
   glm::vec3 worldCenter = scene.getWorldCenter();
-  GLfloat worldSizeHalf = scene.getWorldSize() / 2.0;
+  glm::vec3 worldSizeHalf = getGridSizeHalf();
+  float voxelSize = getGridVoxelSize() * (1 << resolutionLevel);
+  int hasIrradianceCache = diffuseGI && useDiffuseCache(DiffuseCache::VOXELS);
+  int hasIrradianceProbes = diffuseGI && useDiffuseCache(DiffuseCache::PROBES);
+  if (hasIrradianceCache)
+    updateIrradianceCache(voxelSize);
+  if (hasIrradianceProbes)
+    updateProbes(voxelSize);
   glm::vec3 camPosition = camera.position;
   glm::mat4 viewT = camera.getViewMatrix();
   glm::mat4 projectionT = glm::perspective(
       glm::radians(camera.zoom),
       (GLfloat)VIEWPORT_WIDTH / (GLfloat)VIEWPORT_HEIGHT, 0.1f, 5000.0f);
+  if (backend == VoxelBackend::OCTREE) {
+    worldSizeHalf = glm::vec3(0.5f * scene.getWorldSize());
+    voxelSize = scene.getWorldSize() / octree.getDim();
+  } else if (backend == VoxelBackend::CLIPMAP) {
+    // Trace against the coarsest level, its voxels are subdivided down to the
+    // voxel size of the finest level.
+    int level = CLIPMAP_LEVELS - 1;
+    voxelSize = getClipmapVoxelSize(0);
+    worldSizeHalf = glm::vec3(0.5f * CLIPMAP_DIM * getClipmapVoxelSize(level));
+    worldCenter = (glm::vec3(clipmapOrigins[level]) + 0.5f * CLIPMAP_DIM) *
+                  getClipmapVoxelSize(level);
+  }
   renderShader.use();
   renderShader.setUniform(uniformType::mat4x4, glm::value_ptr(modelT), "M");
-  renderShader.setUniform(uniformType::i1, &VOXEL_DIM, "VOXEL_DIM");
+  renderShader.setUniform(uniformType::f1, &voxelSize, "voxelSize");
   renderShader.setUniform(uniformType::fv3, glm::value_ptr(lightPosition),
                           "lightPosition");
   renderShader.setUniform(uniformType::fv3, glm::value_ptr(lightColor),
                           "lightColor");
   renderShader.setUniform(uniformType::fv3, glm::value_ptr(worldCenter),
                           "worldCenter");
-  renderShader.setUniform(uniformType::f1, &worldSizeHalf, "worldSizeHalf");
+  renderShader.setUniform(uniformType::fv3, glm::value_ptr(worldSizeHalf),
+                          "worldSizeHalf");
   renderShader.setUniform(uniformType::mat4x4,
                           glm::value_ptr(shadowMap.getLightSpaceMatrix()),
                           "lightSpaceMatrix");
@@ -118,11 +2039,47 @@ void VoxelMap::render(Camera &camera, glm::vec3 lightPosition,
   GLuint voxelTextureUnit = 0;
   renderShader.setUniform(uniformType::i1, &voxelTextureUnit, "voxelTexture");
   glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_3D, voxelTexture);
+  glBindTexture(GL_TEXTURE_3D, voxelView);
   GLuint shadowMapUnit = 1;
   renderShader.setUniform(uniformType::i1, &shadowMapUnit, "shadowMap");
   glActiveTexture(GL_TEXTURE1);
   glBindTexture(GL_TEXTURE_2D, shadowMap.getDepthMapTexture());
+  bindBackend(renderShader, 5);
+  int filter = (int)mipmapFilter;
+  renderShader.setUniform(uniformType::i1, &filter, "mipmapFilter");
+  int anisotropicVoxels = backend == VoxelBackend::DENSE && anisotropic;
+  GLuint directionalUnit = 12;
+  renderShader.setUniform(uniformType::i1, &anisotropicVoxels,
+                          "anisotropicVoxels");
+  renderShader.setUniform(uniformType::i1, &directionalUnit,
+                          "directionalVoxels");
+  glActiveTexture(GL_TEXTURE0 + directionalUnit);
+  glBindTexture(GL_TEXTURE_3D, directionalView);
+  bindOpacity(renderShader, 13);
+  bindProxy(renderShader, 14, voxelSize);
+  bindOccupancy(renderShader, 15);
+  GLuint irradianceUnit = 16;
+  renderShader.setUniform(uniformType::i1, &hasIrradianceCache,
+                          "hasIrradianceCache");
+  renderShader.setUniform(uniformType::i1, &irradianceUnit, "irradianceCache");
+  renderShader.setUniform(uniformType::i1, &hasIrradianceProbes,
+                          "hasIrradianceProbes");
+  renderShader.setUniform(uniformType::i1, &irradianceUnit,
+                          "irradianceProbes");
+  if (hasIrradianceProbes) {
+    int visibility = probeVisibility;
+    renderShader.setUniform(uniformType::iv3, glm::value_ptr(probeDim),
+                            "probeDim");
+    renderShader.setUniform(uniformType::fv3, glm::value_ptr(probeMin),
+                            "probeMin");
+    renderShader.setUniform(uniformType::f1, &probeWorldSpacing,
+                            "probeSpacing");
+    renderShader.setUniform(uniformType::i1, &visibility, "probeVisibility");
+  }
+  if (hasIrradianceCache || hasIrradianceProbes) {
+    glActiveTexture(GL_TEXTURE0 + irradianceUnit);
+    glBindTexture(GL_TEXTURE_3D, irradianceTexture);
+  }
   glViewport(EDITOR_WIDTH, 0, VIEWPORT_WIDTH, VIEWPORT_HEIGHT);
   scene.draw(renderShader, 2);
   // reset viewport
@@ -132,18 +2089,17 @@ void VoxelMap::render(Camera &camera, glm::vec3 lightPosition,
 void VoxelMap::visualize(Camera &camera) {
   glm::mat4 modelT = glm::mat4(1.0f);
   glm::vec3 worldCenter = scene.getWorldCenter();
-  GLfloat worldSizeHalf = scene.getWorldSize() / 2.0;
+  glm::vec3 worldSizeHalf = glm::vec3(0.5f * scene.getWorldSize());
+  if (backend == VoxelBackend::DENSE)
+    worldSizeHalf = getGridSizeHalf();
 
   visualizationShader.use();
   visualizationShader.setUniform(uniformType::mat4x4, glm::value_ptr(modelT),
                                  "M");
   visualizationShader.setUniform(uniformType::fv3, glm::value_ptr(worldCenter),
                                  "worldCenter");
-  visualizationShader.setUniform(uniformType::f1, &worldSizeHalf,
-                                 "worldSizeHalf");
-  visualizationShader.setUniform(uniformType::fv3, glm::value_ptr(worldCenter),
-                                 "worldCenter");
-  visualizationShader.setUniform(uniformType::f1, &worldSizeHalf,
+  visualizationShader.setUniform(uniformType::fv3,
+                                 glm::value_ptr(worldSizeHalf),
                                  "worldSizeHalf");
   glm::mat4 viewT = camera.getViewMatrix();
   visualizationShader.setUniform(uniformType::mat4x4, glm::value_ptr(viewT),
@@ -158,6 +2114,9 @@ void VoxelMap::visualize(Camera &camera) {
   visualizationShader.setUniform(uniformType::i1, &voxelTextureUnit,
                                  "voxelTexture");
   glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_3D, voxelTexture);
+  glBindTexture(GL_TEXTURE_3D, voxelView);
+  bindBackend(visualizationShader, 5);
+  bindOpacity(visualizationShader, 13);
+  bindProxy(visualizationShader, 14, getGridVoxelSize());
   scene.draw(visualizationShader, 1);
 }
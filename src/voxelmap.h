@@ -2,6 +2,8 @@
 #define VOXEL_MAP_H
 
 #include "camera.h"
+#include "constants.h"
+#include "octree.h"
 #include "scene.h"
 #include "shader.h"
 #include "shadowmap.h"
@@ -9,25 +11,220 @@
 
 #include <vector>
 
+enum class VoxelBackend { DENSE, OCTREE, CLIPMAP };
+enum class MipmapFilter { BOX, OPACITY_WEIGHTED };
+enum class VoxelFormat { RGBA8, R11G11B10F, RGBA16F };
+// How triangles are projected along their dominant axis: per triangle in a
+// geometry shader, or per vertex with the triangles pre-binned by axis.
+enum class VoxelizePath { GEOMETRY_SHADER, AXIS_BINNED };
+// Steps of a dense grid rebuild in the back volumes, each done in slabs over
+// one or more frames, before waiting on the fence that swaps them to the
+// front.
+enum class RebuildStage { STATIC, LIGHT, MIPMAPS, FENCE, IDLE };
+// Where fragments get their indirect diffuse light from: their own cones, a
+// cache with a texel per block of voxels, or a coarser grid of probes.
+enum class DiffuseCache { NONE, VOXELS, PROBES };
+
 class VoxelMap {
 private:
-  GLuint voxelTexture;
-  Shader voxelizeShader;
+  // The lit volumes of the dense grid. Six directional mip volumes (+X, -X,
+  // +Y, -Y, +Z, -Z) side by side along x, each at half the base resolution,
+  // replace the mips of the voxel texture when anisotropic.
+  struct DenseVolume {
+    GLuint voxelTexture;
+    GLuint opacityTexture; // opacity of voxel formats without alpha
+    GLuint directionalTexture;
+  };
+  // Cone tracing samples the front volume. Full voxelizations and relights
+  // are rebuilt in the back volume over a few frames and swapped in once a
+  // fence says the GPU is done with them, small region updates go straight
+  // to the front.
+  DenseVolume volumes[2];
+  int frontVolume;
+  bool doubleBuffered;
+  bool frontValid; // the front volume holds a voxelization
+  RebuildStage rebuildStage;
+  int rebuildSlab; // first z of the next slab of the stage
+  GLsync rebuildFence;
+  // GPU time a frame may spend on a rebuild in ms, 0 runs a whole stage per
+  // frame. The slabs that fit are estimated from the time slabs of the same
+  // stage took, read back from timer queries once they are available.
+  float rebuildBudget;
+  float slabTimes[3];
+  float rebuildTime;
+  struct RebuildQuery {
+    GLuint query;
+    int stage;
+    int slabs;
+    bool pending;
+  };
+  static const int REBUILD_QUERIES = 8;
+  RebuildQuery rebuildQueries[REBUILD_QUERIES];
+  int nextRebuildQuery;
+  glm::vec3 rebuildLightPosition;
+  glm::vec3 rebuildLightColor;
+  int rebuildHasShadows;
+  // Region updated in the front during a rebuild, replayed after the swap.
+  glm::ivec3 staleMin, staleMax;
+  GLuint geometryTextures[3]; // albedo, normal, material of static meshes
+  // Emissive color of every material, the light injection looks it up by the
+  // material ID of the voxels.
+  GLuint materialBuffer;
+  // The dense grid can leave the rigid dynamic meshes out and keep them in
+  // an object space proxy volume instead, traced with the inverse of their
+  // transform. The dynamic meshes share one translation, so they form a
+  // single proxy. Moving it only relights its voxels.
+  bool rigidProxy;
+  GLuint proxyTexture; // lit RGBA8, with mips
+  GLuint proxyGeometryTextures[3];
+  int proxyDim;
+  float proxyVoxelSize;
+  glm::vec3 proxyLocalMin; // object space corner of the proxy
+  // Occupancy of the front volume and the proxy, rebuilt after every change
+  // of it: a bit per voxel, packed OCCUPANCY_BLOCK_DIM^3 bits to a uvec2,
+  // followed by OR reduced levels with a bit per uvec2 of the level below.
+  // A coarse distance field with a cell per block of the first level, an
+  // exact transform of it, gives a lower bound of the world distance to the
+  // nearest occupied block.
+  // The specular cone skips ahead through the space the field shows to be
+  // empty and tests the mask before fetching radiance closer to the
+  // surfaces. The diffuse cones are wide enough to overlap the surface they
+  // start from all along.
+  static const int OCCUPANCY_BLOCK_DIM = 4;
+  static const int OCCUPANCY_LEVELS = 3;
+  bool skipEmptySpace;
+  GLuint occupancyBuffer;
+  glm::ivec3 occupancyDim; // blocks of the first level
+  GLuint distanceTexture;      // R32F
+  GLuint transformTextures[2]; // squared distances, ping-ponged per axis
+  // Indirect diffuse light of the blocks of the first occupancy level that
+  // have voxels, as an ambient cube: six RGBA16F volumes (+X, -X, +Y, -Y,
+  // +Z, -Z) side by side along x, alpha marks the blocks that have light.
+  // Fragments look it up with their normal instead of tracing diffuse cones.
+  // The blocks are traced again a few slices along z every frame.
+  DiffuseCache diffuseCache;
+  GLuint irradianceTexture; // of the cache or the probe grid, when in use
+  int irradianceSlices;     // slices traced a frame
+  int irradianceSlice;      // first slice of the next frame
+  bool irradianceValid; // all of it was traced since the volumes were made
+  // The probe grid spans the scene bounds with probes probeSpacing voxels
+  // apart, at most MAX_PROBE_DIM along an axis. Each probe keeps an ambient
+  // cube in the layout of the cache, alpha is how far the cone along each
+  // axis gets before it is occluded. Fragments blend the eight probes
+  // around them, with probeVisibility only those the cones say they can
+  // see and that are in front of them.
+  static const int MAX_PROBE_DIM = 64;
+  int probeSpacing;
+  glm::ivec3 probeDim;
+  glm::vec3 probeMin; // world position of the first probe
+  float probeWorldSpacing;
+  int probesPerFrame;
+  int nextProbe;
+  bool probeVisibility;
+  // With multiple bounces the back volume is lit a few slices along z every
+  // frame, the voxels also getting the light they gather from the front
+  // volume. The volumes are swapped after every sweep over the grid, so each
+  // sweep adds a bounce.
+  bool multiBounce;
+  int bounceSlices; // slices lit again a frame
+  int bounceSlice;  // first slice of the next frame, 0 between sweeps
+  // The dense grid is fitted to the scene bounds, VOXEL_DIM voxels span its
+  // longest axis.
+  glm::ivec3 gridDim;
+  bool staticBaked; // the geometry volumes were loaded from a bake
+  // Cone tracing and visualization sample views of the dense volumes that
+  // start at mip resolutionLevel, so lower resolutions reuse the mips of the
+  // finest voxelization.
+  int resolutionLevel;
+  GLuint voxelView, opacityView, directionalView;
+  VoxelBackend backend;
+  bool octreeFull; // the octree did not fit, the dense grid is used instead
+  bool averageVoxels;
+  // Averaged voxels sum their fragments in fixed point, per channel in a slab
+  // of ACCUMULATION_DEPTH slices: color, normal and the fragment count.
+  static const int ACCUMULATION_DEPTH = 16;
+  static const int ACCUMULATION_CHANNELS = 7;
+  GLuint accumulationTexture;
+  glm::ivec2 accumulationDim; // voxels along x and y
+  bool anisotropic;
+  MipmapFilter mipmapFilter;
+  VoxelFormat voxelFormat;
+  VoxelizePath voxelizePath;
+  bool hybridVoxelize; // voxelize triangles smaller than a voxel in compute
+  bool conservative;   // grow triangles by half a voxel in the geometry shader
+  float voxelizeVoxelSize;
+  GLuint voxelizeQuery;
+  float voxelizeTime; // GPU time of the last full voxelization, in ms
+  Shader geometryVoxelizeShader;
+  Shader axisVoxelizeShader;
+  Shader triangleVoxelizeShader;
   Shader visualizationShader;
   Shader renderShader;
+  Shader mipmapShader;
+  Shader injectionShader;
+  Shader resolveShader;
+  Shader anisotropicShader;
+  Shader occupancyShader;
+  Shader distanceShader;
+  Shader irradianceShader;
   Scene &scene;
   ShadowMap &shadowMap;
+  VoxelOctree &octree;
+
+  // Clipmap: nested camera centered cascades of CLIPMAP_DIM^3 voxels, level i
+  // has voxels 2^i times the size of level 0. Each level is addressed
+  // toroidally (world voxel modulo CLIPMAP_DIM) so it can scroll.
+  const int CLIPMAP_LEVELS = 6;
+  const int CLIPMAP_DIM = 128;
+  std::vector<GLuint> clipmapTextures;
+  std::vector<glm::ivec3> clipmapOrigins;
+  glm::vec3 clipmapCenter;
+  float clipmapVoxelSize;
 
 public:
   VoxelMap(const char *voxelizeVsPath, const char *voxelizeFsPath,
-           const char *voxelizeGsPath, const char *visualizeVsPath,
+           const char *voxelizeGsPath, const char *voxelizeAxisVsPath,
+           const char *voxelizeTrianglesCsPath, const char *visualizeVsPath,
            const char *visualizeFsPath, const char *renderVsPath,
-           const char *renderFsPath, Scene &_scene, ShadowMap &_shadowMap)
-      : scene(_scene), shadowMap(_shadowMap),
-        voxelizeShader(voxelizeVsPath, voxelizeFsPath, voxelizeGsPath),
+           const char *renderFsPath, const char *mipmapCsPath,
+           const char *injectionCsPath, const char *resolveCsPath,
+           const char *anisotropicCsPath, const char *occupancyCsPath,
+           const char *distanceCsPath, const char *irradianceCsPath,
+           Scene &_scene, ShadowMap &_shadowMap, VoxelOctree &_octree)
+      : frontVolume(0), doubleBuffered(true), frontValid(false),
+        rebuildStage(RebuildStage::IDLE), rebuildSlab(0), rebuildFence(0),
+        rebuildBudget(4.0f), rebuildTime(0.0f), nextRebuildQuery(0),
+        rigidProxy(false), proxyTexture(0), skipEmptySpace(true),
+        distanceTexture(0), diffuseCache(DiffuseCache::NONE),
+        irradianceTexture(0), irradianceSlices(8), irradianceSlice(0),
+        irradianceValid(false), probeSpacing(16), probesPerFrame(1024),
+        nextProbe(0), probeVisibility(true), multiBounce(false),
+        bounceSlices(16), bounceSlice(0), resolutionLevel(0),
+        voxelView(0), opacityView(0), directionalView(0),
+        backend(VoxelBackend::DENSE), octreeFull(false), averageVoxels(false),
+        accumulationTexture(0), accumulationDim(0), anisotropic(false),
+        mipmapFilter(MipmapFilter::BOX), voxelFormat(VoxelFormat::RGBA8),
+        voxelizePath(VoxelizePath::GEOMETRY_SHADER), hybridVoxelize(false),
+        conservative(false),
+        voxelizeVoxelSize(0.0f), voxelizeTime(0.0f),
+        scene(_scene), shadowMap(_shadowMap), octree(_octree),
+        clipmapCenter(0.0f),
+        geometryVoxelizeShader(voxelizeVsPath, voxelizeFsPath, voxelizeGsPath),
+        axisVoxelizeShader(voxelizeAxisVsPath, voxelizeFsPath),
+        triangleVoxelizeShader(voxelizeTrianglesCsPath),
         visualizationShader(visualizeVsPath, visualizeFsPath),
-        renderShader(renderVsPath, renderFsPath) {
+        renderShader(renderVsPath, renderFsPath), mipmapShader(mipmapCsPath),
+        injectionShader(injectionCsPath), resolveShader(resolveCsPath),
+        anisotropicShader(anisotropicCsPath), occupancyShader(occupancyCsPath),
+        distanceShader(distanceCsPath), irradianceShader(irradianceCsPath) {
     initTexture();
+    glGenQueries(1, &voxelizeQuery);
+    glGenBuffers(1, &materialBuffer);
+    for (int i = 0; i < REBUILD_QUERIES; i++) {
+      glGenQueries(1, &rebuildQueries[i].query);
+      rebuildQueries[i].pending = false;
+    }
+    clipmapVoxelSize = scene.getWorldSize() / 512.0f;
   }
 
   void initVoxelizeShader(const char *vsPath, const char *fsPath,
@@ -36,15 +233,233 @@ public:
   void initRenderShader(const char *vsPath, const char *fsPath);
 
   void resizeTexture();
+  void setResolutionLevel(int level);
+  int getResolutionLevel() { return resolutionLevel; }
+  void setDoubleBuffered(bool _doubleBuffered);
+  bool getDoubleBuffered() { return doubleBuffered; }
+  bool isRebuilding() { return rebuildStage != RebuildStage::IDLE; }
+  float getRebuildProgress();
+  void setRebuildBudget(float _rebuildBudget) {
+    rebuildBudget = _rebuildBudget;
+  }
+  float getRebuildBudget() { return rebuildBudget; }
+  void setRigidProxy(bool _rigidProxy);
+  bool getRigidProxy() { return rigidProxy; }
+  void setSkipEmptySpace(bool _skipEmptySpace) {
+    skipEmptySpace = _skipEmptySpace;
+  }
+  bool getSkipEmptySpace() { return skipEmptySpace; }
+  void setDiffuseCache(DiffuseCache _diffuseCache);
+  DiffuseCache getDiffuseCache() { return diffuseCache; }
+  void setIrradianceSlices(int _irradianceSlices) {
+    irradianceSlices = _irradianceSlices;
+  }
+  int getIrradianceSlices() { return irradianceSlices; }
+  void setProbeSpacing(int _probeSpacing);
+  int getProbeSpacing() { return probeSpacing; }
+  glm::ivec3 getProbeDim() { return probeDim; }
+  void setProbesPerFrame(int _probesPerFrame) {
+    probesPerFrame = _probesPerFrame;
+  }
+  int getProbesPerFrame() { return probesPerFrame; }
+  void setProbeVisibility(bool _probeVisibility) {
+    probeVisibility = _probeVisibility;
+  }
+  bool getProbeVisibility() { return probeVisibility; }
+  void setMultiBounce(bool _multiBounce);
+  bool getMultiBounce() { return multiBounce; }
+  void setBounceSlices(int _bounceSlices) { bounceSlices = _bounceSlices; }
+  int getBounceSlices() { return bounceSlices; }
+  void setBackend(VoxelBackend _backend);
+  VoxelBackend getBackend() { return backend; }
+  bool getOctreeFull() { return octreeFull; }
+  void setAverageVoxels(bool _averageVoxels);
+  bool getAverageVoxels() { return averageVoxels; }
+  void setAnisotropic(bool _anisotropic);
+  bool getAnisotropic() { return anisotropic; }
+  void setMipmapFilter(MipmapFilter _mipmapFilter) {
+    mipmapFilter = _mipmapFilter;
+  }
+  MipmapFilter getMipmapFilter() { return mipmapFilter; }
+  void setVoxelFormat(VoxelFormat _voxelFormat);
+  VoxelFormat getVoxelFormat() { return voxelFormat; }
+  void setVoxelizePath(VoxelizePath _voxelizePath) {
+    voxelizePath = _voxelizePath;
+  }
+  VoxelizePath getVoxelizePath() { return voxelizePath; }
+  void setHybridVoxelize(bool _hybridVoxelize) {
+    hybridVoxelize = _hybridVoxelize;
+  }
+  bool getHybridVoxelize() { return hybridVoxelize; }
+  void setConservative(bool _conservative) { conservative = _conservative; }
+  bool getConservative() { return conservative; }
+  float getVoxelizeTime() { return voxelizeTime; }
+  size_t getMemoryUsage();
+  size_t getDenseMemoryUsage(VoxelFormat format);
+  glm::ivec3 getGridDim() { return gridDim; }
+  static glm::ivec3 fitGrid(Scene &scene);
+  std::vector<unsigned char> readGeometryVolume(int volume);
+  std::vector<std::vector<unsigned char>> readGeometryMipmaps(int volume);
+  bool loadBake(const char *path);
+  VoxelOctree &getOctree() { return octree; }
 
   void voxelize(glm::vec3 lightPosition, glm::vec3 lightColor, int hasShadows);
+  void relight(glm::vec3 lightPosition, glm::vec3 lightColor, int hasShadows);
+  void advanceRebuild();
+  void propagateLight(glm::vec3 lightPosition, glm::vec3 lightColor,
+                      int hasShadows);
+  void updateMipmaps();
+  void voxelizeRegion(glm::vec3 boundsMin, glm::vec3 boundsMax,
+                      glm::vec3 lightPosition, glm::vec3 lightColor,
+                      int hasShadows);
+  void updateMaterial(size_t materialId, glm::vec3 lightPosition,
+                      glm::vec3 lightColor, int hasShadows);
+  void updateClipmap(glm::vec3 center, glm::vec3 lightPosition,
+                     glm::vec3 lightColor, int hasShadows);
+  int getClipmapLevels() { return CLIPMAP_LEVELS; }
+  int getClipmapDim() { return CLIPMAP_DIM; }
   void visualize(Camera &camera);
   void render(Camera &camera, glm::vec3 lightPosition, glm::vec3 lightColor,
               int diffuseGI, int specularGI);
 
 private:
   void initTexture();
-  void clear();
+  void releaseTexture();
+  void initVolume(DenseVolume &volume);
+  void releaseVolume(DenseVolume &volume);
+  DenseVolume &front() { return volumes[frontVolume]; }
+  DenseVolume &back() { return volumes[1 - frontVolume]; }
+  bool hasBackVolume() { return doubleBuffered || multiBounce; }
+  float getGridVoxelSize() { return scene.getWorldSize() / VOXEL_DIM; }
+  // Mips of the dense volumes, down to one voxel along the shortest axis of
+  // the grid and at most 7.
+  int getMipLevels() {
+    int minDim = std::min(gridDim.x, std::min(gridDim.y, gridDim.z));
+    int levels = 1;
+    while (levels < 7 && (minDim >> levels) > 0)
+      levels++;
+    return levels;
+  }
+  glm::vec3 getGridSizeHalf() {
+    return 0.5f * getGridVoxelSize() * glm::vec3(gridDim);
+  }
+  GLenum getInternalFormat();
+  GLenum getDirectionalFormat();
+  bool hasSeparateOpacity() {
+    return backend == VoxelBackend::DENSE &&
+           voxelFormat == VoxelFormat::R11G11B10F;
+  }
+  // The floating point formats cannot be averaged atomically.
+  bool isAveraging() {
+    return averageVoxels && (backend != VoxelBackend::DENSE ||
+                             voxelFormat == VoxelFormat::RGBA8);
+  }
+  void initDirectionalTexture(DenseVolume &volume);
+  void releaseDirectionalTexture(DenseVolume &volume);
+  void initViews();
+  void releaseViews();
+  bool useProxy() {
+    return rigidProxy && backend == VoxelBackend::DENSE && proxyTexture != 0;
+  }
+  void initProxy();
+  void releaseProxy();
+  void rebuildProxy(glm::vec3 lightPosition, glm::vec3 lightColor,
+                    int hasShadows);
+  void voxelizeProxy();
+  void lightProxy(glm::vec3 lightPosition, glm::vec3 lightColor,
+                  int hasShadows);
+  void updateProxyMipmaps();
+  void bindProxy(Shader &shader, GLuint unit, float voxelSize);
+  void initOccupancy();
+  void releaseOccupancy();
+  size_t getOccupancyBytes();
+  void updateOccupancy();
+  void updateDistanceField();
+  void bindOccupancy(Shader &shader, GLuint unit);
+  bool useDiffuseCache(DiffuseCache cache) {
+    return diffuseCache == cache && backend == VoxelBackend::DENSE &&
+           frontValid;
+  }
+  void initDiffuseCache();
+  void releaseDiffuseCache();
+  void beginIrradianceTrace(float voxelSize);
+  void updateIrradianceCache(float voxelSize);
+  void updateProbes(float voxelSize);
+  void initClipmap();
+  void releaseClipmap();
+  void clear(glm::ivec3 regionMin, glm::ivec3 regionMax);
+  void beginVoxelize(glm::vec3 lightPosition, glm::vec3 lightColor,
+                     int hasShadows);
+  void setVoxelizeUniform(uniformType type, void *param, char *name);
+  void setVoxelizeVolume(glm::vec3 worldCenter, glm::vec3 worldSizeHalf,
+                         float voxelSize, glm::ivec3 regionMin,
+                         glm::ivec3 regionMax, glm::ivec3 voxelOffset);
+  void beginFragmentList();
+  void endVoxelize();
+  // Conservative voxelization grows whole triangles, so it always goes
+  // through the geometry shader.
+  bool isAxisBinned() {
+    return voxelizePath == VoxelizePath::AXIS_BINNED && !conservative;
+  }
+  Shader &voxelizeShader() {
+    return isAxisBinned() ? axisVoxelizeShader : geometryVoxelizeShader;
+  }
+  void setVoxelizeViewport(int size);
+  void drawVoxelize(glm::vec3 boundsMin, glm::vec3 boundsMax, MeshSet meshSet);
+  void drawVoxelizeRegion(glm::vec3 worldCenter, glm::vec3 worldSizeHalf,
+                          float voxelSize, glm::ivec3 regionMin,
+                          glm::ivec3 regionMax, glm::ivec3 voxelOffset,
+                          MeshSet meshSet, GLuint texture,
+                          GLuint normalTexture);
+  void initAccumulation(glm::ivec2 size);
+  void releaseAccumulation();
+  void voxelizeStatic(glm::ivec3 regionMin, glm::ivec3 regionMax);
+  bool getGridRegion(glm::vec3 boundsMin, glm::vec3 boundsMax,
+                     glm::ivec3 &regionMin, glm::ivec3 &regionMax);
+  void setInjectionLight(glm::vec3 lightPosition, glm::vec3 lightColor,
+                         int hasShadows);
+  void setInjectionBounce(DenseVolume *source);
+  void injectLight(GLuint texture, GLenum format, GLuint opacity,
+                   GLuint *geometry, glm::vec3 worldCenter,
+                   glm::vec3 worldSizeHalf, glm::ivec3 regionMin,
+                   glm::ivec3 regionMax, int material);
+  void lightRegion(DenseVolume &volume, glm::vec3 lightPosition,
+                   glm::vec3 lightColor, int hasShadows, glm::ivec3 regionMin,
+                   glm::ivec3 regionMax);
+  void updateMipmaps(DenseVolume &volume, glm::ivec3 regionMin,
+                     glm::ivec3 regionMax);
+  void updateMipLevels(GLuint texture, GLenum format, GLuint opacityTexture,
+                       glm::ivec3 regionMin, glm::ivec3 regionMax);
+  void updateDirectionalRegion(DenseVolume &volume, glm::ivec3 regionMin,
+                               glm::ivec3 regionMax);
+  void queueRebuild(RebuildStage stage, glm::vec3 lightPosition,
+                    glm::vec3 lightColor, int hasShadows);
+  void cancelRebuild();
+  bool deferRegion(glm::ivec3 regionMin, glm::ivec3 regionMax);
+  // Slabs span the grid in x and y. The mips are built in slabs as deep as a
+  // texel of the coarsest level, so each slab covers whole texels.
+  int getSlabDepth(RebuildStage stage) {
+    return stage == RebuildStage::MIPMAPS ? 1 << (getMipLevels() - 1) : 16;
+  }
+  void runRebuildSlabs();
+  void collectRebuildTimes(bool wait);
+  void swapVolumes();
+  void swapBounce(glm::vec3 lightPosition, glm::vec3 lightColor,
+                  int hasShadows);
+  void markStale(glm::ivec3 regionMin, glm::ivec3 regionMax);
+  void resolveRegion(GLuint texture, GLuint normalTexture,
+                     glm::ivec3 regionMin, glm::ivec3 regionMax,
+                     glm::ivec3 voxelOffset);
+  float getClipmapVoxelSize(int level) {
+    return clipmapVoxelSize * (1 << level);
+  }
+  glm::ivec3 getClipmapOrigin(int level, glm::vec3 center);
+  void clearClipmapRegion(int level, glm::ivec3 regionMin,
+                          glm::ivec3 regionMax);
+  void voxelizeClipmapRegion(int level, glm::ivec3 regionMin,
+                             glm::ivec3 regionMax);
+  void bindBackend(Shader &shader, GLuint firstUnit);
+  void bindOpacity(Shader &shader, GLuint unit);
 };
 
 #endif /* ifndef VOXEL_MAP_H */